@@ -0,0 +1,276 @@
+// Stands in for the upstream server while benchmarking, answering each query
+// over TCP with the captured response to the same question. Any datagram
+// sent to the same port gets back how many queries have been answered, as
+// 8 bytes in network byte order, so clients can tell cache hits apart.
+//
+// Usage: bench/fake_upstream [-d delay_us] port packets/*.res.raw
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "../message.h"
+
+#define TCP_HEADER_SIZE 2       // Size of TCP header
+#define MAX_MSG_SIZE 65535      // Largest message after a TCP prefix
+#define MAX_ANSWERS 256         // Most captured responses loaded
+#define BACKLOG 64              // Connections waiting to be accepted
+#define QR_FLAG 0x8000          // Marks the message as a response
+#define SERVFAIL 2              // Rcode sent for questions with no capture
+#define NS_PER_SEC 1000000000L
+#define NS_PER_US 1000L
+
+// Captured responses, and how long to hold each answer back
+static Message *answers[MAX_ANSWERS];
+static int answer_count = 0;
+static long delay_ns = 0;
+
+// Queries answered over every connection
+static atomic_ulong answered = 0;
+
+// Checks if two questions ask for the same type of the same name, ignoring
+// case
+int match_qn(Message *a, Message *b) {
+    int i;
+
+    if (a->qn.qtype != b->qn.qtype || a->qn.name.len != b->qn.name.len) {
+        return 0;
+    }
+
+    for (i = 0; i < a->qn.name.len; i++) {
+        if (tolower(a->buffer[a->qn.name.off + i]) !=
+            tolower(b->buffer[b->qn.name.off + i])) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Writes the answer to a query into buffer after its TCP prefix, returns its
+// length with the prefix
+int make_answer(Message *query, unsigned char *buffer) {
+    int i;
+
+    for (i = 0; i < answer_count; i++) {
+        if (match_qn(query, answers[i])) {
+            memcpy(buffer + TCP_HEADER_SIZE, answers[i]->buffer,
+                answers[i]->size);
+            put_two_bytes(buffer, 0, answers[i]->size);
+            put_two_bytes(buffer + TCP_HEADER_SIZE, ID_OFF, get_id(query));
+            return TCP_HEADER_SIZE + answers[i]->size;
+        }
+    }
+
+    // Nothing captured, so the query comes back as a failure
+    memcpy(buffer + TCP_HEADER_SIZE, query->buffer, query->size);
+    put_two_bytes(buffer, 0, query->size);
+    put_two_bytes(buffer + TCP_HEADER_SIZE, FLAGS_OFF,
+        (get_flags(query) & ~0xf) | QR_FLAG | SERVFAIL);
+    return TCP_HEADER_SIZE + query->size;
+}
+
+// Reads exactly num_bytes from the socket, returns -1 if it fails
+int read_exactly(const int sockfd, unsigned char *buffer, int num_bytes) {
+    int status, bytes_read = 0;
+
+    while (bytes_read < num_bytes) {
+        status = read(sockfd, buffer + bytes_read, num_bytes - bytes_read);
+        if (status < 0 && errno == EINTR) {
+            continue;
+        } else if (status <= 0) {
+            return -1;
+        }
+        bytes_read += status;
+    }
+
+    return 0;
+}
+
+// Writes exactly num_bytes to the socket, returns -1 if it fails
+int write_exactly(const int sockfd, unsigned char *buffer, int num_bytes) {
+    int status, bytes_written = 0;
+
+    while (bytes_written < num_bytes) {
+        status = write(sockfd, buffer + bytes_written,
+            num_bytes - bytes_written);
+        if (status < 0 && errno == EINTR) {
+            continue;
+        } else if (status < 0) {
+            return -1;
+        }
+        bytes_written += status;
+    }
+
+    return 0;
+}
+
+// Answers the queries pipelined over one connection until it closes
+void *serve_connection(void *param) {
+    unsigned char *query = malloc(MAX_MSG_SIZE);
+    unsigned char *reply = malloc(TCP_HEADER_SIZE + MAX_MSG_SIZE);
+    int sockfd = (int)(long)param, size, len;
+    struct timespec due;
+    Message msg;
+
+    assert(query && reply);
+
+    while (read_exactly(sockfd, query, TCP_HEADER_SIZE) == 0 &&
+        (size = (query[0] << 8) | query[1]) > 0 &&
+        read_exactly(sockfd, query, size) == 0) {
+        if (parse_msg(&msg, query, size) < 0) {
+            break;
+        }
+
+        // Queries that arrived together are answered together, however
+        // many are waiting on the connection
+        if (delay_ns > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &due);
+            due.tv_nsec += delay_ns;
+            due.tv_sec += due.tv_nsec / NS_PER_SEC;
+            due.tv_nsec %= NS_PER_SEC;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due,
+                NULL) == EINTR);
+        }
+
+        len = make_answer(&msg, reply);
+        if (write_exactly(sockfd, reply, len) < 0) {
+            break;
+        }
+        atomic_fetch_add_explicit(&answered, 1, memory_order_relaxed);
+    }
+
+    close(sockfd);
+    free(query);
+    free(reply);
+
+    return NULL;
+}
+
+// Tells anyone sending a datagram how many queries have been answered
+void *serve_count(void *param) {
+    int sockfd = (int)(long)param, i;
+    struct sockaddr_in addr;
+    socklen_t addr_len;
+    unsigned char buffer[8];
+    unsigned long count;
+
+    while (1) {
+        addr_len = sizeof(addr);
+        if (recvfrom(sockfd, buffer, sizeof(buffer), 0,
+            (struct sockaddr*)&addr, &addr_len) < 0) {
+            continue;
+        }
+
+        count = atomic_load(&answered);
+        for (i = 7; i >= 0; i--) {
+            buffer[i] = count & 0xff;
+            count >>= 8;
+        }
+        sendto(sockfd, buffer, sizeof(buffer), 0, (struct sockaddr*)&addr,
+            addr_len);
+    }
+
+    return NULL;
+}
+
+// Reads a captured message, skipping files that are not one whole message
+Message *load_msg(const char *path) {
+    static unsigned char buffer[TCP_HEADER_SIZE + MAX_MSG_SIZE];
+    FILE *file = fopen(path, "rb");
+    int len, size;
+
+    if (!file) {
+        perror(path);
+        return NULL;
+    }
+
+    len = fread(buffer, 1, sizeof(buffer), file);
+    fclose(file);
+
+    size = len >= TCP_HEADER_SIZE ? (buffer[0] << 8) | buffer[1] : -1;
+    if (size + TCP_HEADER_SIZE != len) {
+        return NULL;
+    }
+
+    return create_msg(buffer + TCP_HEADER_SIZE, size);
+}
+
+// Opens a socket of the given type bound to the port on every address
+int bind_socket(int type, int port) {
+    struct sockaddr_in addr;
+    int sockfd, enable = 1;
+
+    if ((sockfd = socket(AF_INET, type, 0)) < 0) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        exit(EXIT_FAILURE);
+    }
+
+    return sockfd;
+}
+
+int main(int argc, char *argv[]) {
+    int opt, i, port, listener, sockfd;
+    pthread_t thread;
+    Message *msg = NULL;
+
+    while ((opt = getopt(argc, argv, "d:")) != -1) {
+        if (opt == 'd') {
+            delay_ns = atol(optarg)*NS_PER_US;
+        } else {
+            optind = argc;
+            break;
+        }
+    }
+
+    if (argc - optind < 2) {
+        fprintf(stderr, "usage: %s [-d delay_us] port response.raw ...\n",
+            argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    port = atoi(argv[optind]);
+
+    for (i = optind + 1; i < argc && answer_count < MAX_ANSWERS; i++) {
+        if ((msg = load_msg(argv[i])) && msg->qn_count > 0) {
+            answers[answer_count++] = msg;
+        } else if (msg) {
+            free_msg(msg);
+        }
+    }
+    fprintf(stderr, "loaded %d responses\n", answer_count);
+
+    sockfd = bind_socket(SOCK_DGRAM, port);
+    pthread_create(&thread, NULL, serve_count, (void*)(long)sockfd);
+    pthread_detach(thread);
+
+    listener = bind_socket(SOCK_STREAM, port);
+    if (listen(listener, BACKLOG) < 0) {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+
+    while (1) {
+        if ((sockfd = accept(listener, NULL, NULL)) < 0) {
+            continue;
+        }
+        pthread_create(&thread, NULL, serve_connection, (void*)(long)sockfd);
+        pthread_detach(thread);
+    }
+
+    return 0;
+}
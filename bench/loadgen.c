@@ -0,0 +1,579 @@
+// Replays captured queries against dns_svr at a fixed rate, whether or not
+// earlier ones have been answered, and reports the throughput, latency
+// percentiles and cache hit ratio. Latency is measured from when each query
+// was due to be sent, so a stalled server cannot hide its own backlog.
+//
+// Over UDP each socket carries any number of queries at once. Over TCP each
+// connection carries one at a time, and is opened again when the server
+// closes it. The hit ratio needs the port of bench/fake_upstream, which
+// counts the queries the server passed on.
+//
+// Usage: bench/loadgen [-r rate] [-c connections] [-t threads] [-d seconds]
+//            [-T] [-u upstream_port] ip port packets/*.req.raw
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "../message.h"
+
+#define TCP_HEADER_SIZE 2       // Size of TCP header
+#define MAX_MSG_SIZE 65535      // Largest message after a TCP prefix
+#define MAX_QUERIES 256         // Most captured queries loaded
+#define MAX_THREADS 64          // Most threads sending queries
+#define MAX_CONNECTIONS 1024    // Most sockets per thread
+#define ID_SLOTS 65536          // Queries a thread can have unanswered
+#define DRAIN_TIME 1000000000L  // Time in ns to wait for late answers
+#define COUNT_TIMEOUT 1000      // Time in ms to wait for the upstream count
+#define NS_PER_SEC 1000000000L
+#define NS_PER_US 1000L
+
+// Queries to replay, without their TCP prefix
+typedef struct {
+    unsigned char *buffer;
+    int size;
+} Query;
+
+// One socket of a thread, and for TCP the query it is waiting on
+typedef struct {
+    int sockfd;
+    int busy;
+    int fresh;              // Opened for the query it is waiting on
+    int query;
+    long due;
+
+    // Reply read so far, with its TCP prefix
+    unsigned char *buffer;
+    int bytes_read;
+} Socket;
+
+// State of one sending thread, with the latencies it measured in ns
+typedef struct {
+    int index;
+    long interval;
+    int socket_count;
+    Socket sockets[MAX_CONNECTIONS];
+    struct pollfd fds[MAX_CONNECTIONS];
+
+    // Send times of unanswered UDP queries, by ID, zero for none
+    long *sent;
+    u_int16_t next_id;
+
+    // Due times of TCP queries waiting for a free connection
+    long *backlog;
+    int backlog_head;
+    int backlog_count;
+
+    long queries_sent;
+    long lost;
+    long *latencies;
+    long latency_count;
+    long latency_size;
+} Worker;
+
+static Query queries[MAX_QUERIES];
+static int query_count = 0;
+static struct addrinfo *server = NULL;
+static int use_tcp = 0;
+static long duration = 10*NS_PER_SEC;
+
+// Gets the current time in nanoseconds
+long get_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec*NS_PER_SEC + ts.tv_nsec;
+}
+
+// Adds the latency of an answered query
+void record_latency(Worker *worker, long latency) {
+    if (worker->latency_count == worker->latency_size) {
+        worker->latency_size *= 2;
+        worker->latencies = realloc(worker->latencies,
+            worker->latency_size*sizeof(long));
+        assert(worker->latencies);
+    }
+
+    worker->latencies[worker->latency_count++] = latency;
+}
+
+// Opens a socket to the server, returns -1 if it fails
+int open_socket(Socket *sock) {
+    int type = use_tcp ? SOCK_STREAM : SOCK_DGRAM;
+
+    if ((sock->sockfd = socket(server->ai_family, type, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    if (connect(sock->sockfd, server->ai_addr, server->ai_addrlen) < 0) {
+        close(sock->sockfd);
+        sock->sockfd = -1;
+        return -1;
+    }
+
+    sock->bytes_read = 0;
+    return 0;
+}
+
+// Closes a socket, to be opened again on its next query
+void close_socket(Socket *sock) {
+    close(sock->sockfd);
+    sock->sockfd = -1;
+    sock->busy = 0;
+}
+
+// Sends the next query over UDP, round robin over the sockets
+void send_datagram(Worker *worker, long due) {
+    Socket *sock = &worker->sockets[worker->queries_sent %
+        worker->socket_count];
+    Query *query = &queries[(worker->index + worker->queries_sent) %
+        query_count];
+    unsigned char buffer[MAX_MSG_SIZE];
+    u_int16_t id = worker->next_id++;
+
+    // An ID still in use belongs to a query that will never be answered
+    if (worker->sent[id]) {
+        worker->lost++;
+    }
+
+    memcpy(buffer, query->buffer, query->size);
+    put_two_bytes(buffer, ID_OFF, id);
+    worker->sent[id] = due;
+    worker->queries_sent++;
+
+    if (send(sock->sockfd, buffer, query->size, 0) < 0) {
+        worker->sent[id] = 0;
+        worker->lost++;
+    }
+}
+
+// Reads the answers waiting on a UDP socket
+void read_datagrams(Worker *worker, Socket *sock) {
+    unsigned char buffer[MAX_MSG_SIZE];
+    int size;
+    u_int16_t id;
+
+    while ((size = recv(sock->sockfd, buffer, sizeof(buffer),
+        MSG_DONTWAIT)) >= HEADER_SIZE) {
+        id = (buffer[0] << 8) | buffer[1];
+        if (worker->sent[id]) {
+            record_latency(worker, get_ns() - worker->sent[id]);
+            worker->sent[id] = 0;
+        }
+    }
+}
+
+// Sends a query over a free TCP connection, returns -1 if none could take it
+int send_stream(Worker *worker, long due, int query_index) {
+    unsigned char buffer[TCP_HEADER_SIZE + MAX_MSG_SIZE];
+    Query *query = &queries[query_index];
+    Socket *sock = NULL;
+    int i;
+
+    for (i = 0; i < worker->socket_count; i++) {
+        if (!worker->sockets[i].busy) {
+            sock = &worker->sockets[i];
+            break;
+        }
+    }
+    if (!sock) {
+        return -1;
+    }
+
+    sock->fresh = sock->sockfd < 0;
+    if (sock->sockfd < 0 && open_socket(sock) < 0) {
+        worker->lost++;
+        return 0;
+    }
+
+    put_two_bytes(buffer, 0, query->size);
+    memcpy(buffer + TCP_HEADER_SIZE, query->buffer, query->size);
+    if (send(sock->sockfd, buffer, TCP_HEADER_SIZE + query->size,
+        MSG_NOSIGNAL) < 0) {
+        close_socket(sock);
+        worker->lost++;
+        return 0;
+    }
+
+    sock->busy = 1;
+    sock->query = query_index;
+    sock->due = due;
+    sock->bytes_read = 0;
+
+    return 0;
+}
+
+// Reads the answer waiting on a TCP connection, sending the query again if
+// the server closed a connection it had answered before
+void read_stream(Worker *worker, Socket *sock) {
+    int status, size;
+
+    status = recv(sock->sockfd, sock->buffer + sock->bytes_read,
+        TCP_HEADER_SIZE + MAX_MSG_SIZE - sock->bytes_read, MSG_DONTWAIT);
+    if (status < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+
+    if (status <= 0) {
+        if (sock->busy && !sock->fresh) {
+            close_socket(sock);
+            send_stream(worker, sock->due, sock->query);
+        } else {
+            worker->lost += sock->busy;
+            close_socket(sock);
+        }
+        return;
+    }
+
+    sock->bytes_read += status;
+    if (sock->bytes_read < TCP_HEADER_SIZE) {
+        return;
+    }
+
+    size = (sock->buffer[0] << 8) | sock->buffer[1];
+    if (sock->busy && sock->bytes_read >= TCP_HEADER_SIZE + size) {
+        record_latency(worker, get_ns() - sock->due);
+        sock->busy = 0;
+        sock->bytes_read = 0;
+    }
+}
+
+// Sends every query that is due, returns the time the next one is
+long send_due(Worker *worker, long start, long now) {
+    long due = start + worker->queries_sent*worker->interval;
+    int query_index, slot;
+
+    while (due <= now && due < start + duration) {
+        if (!use_tcp) {
+            send_datagram(worker, due);
+        } else if (worker->backlog_count < ID_SLOTS) {
+            slot = (worker->backlog_head + worker->backlog_count) % ID_SLOTS;
+            worker->backlog[slot] = due;
+            worker->backlog_count++;
+            worker->queries_sent++;
+        } else {
+            worker->queries_sent++;
+            worker->lost++;
+        }
+        due = start + worker->queries_sent*worker->interval;
+    }
+
+    // Waiting TCP queries go out as connections free up
+    while (use_tcp && worker->backlog_count > 0) {
+        query_index = (worker->index + worker->queries_sent -
+            worker->backlog_count) % query_count;
+        if (send_stream(worker, worker->backlog[worker->backlog_head],
+            query_index) < 0) {
+            break;
+        }
+        worker->backlog_head = (worker->backlog_head + 1) % ID_SLOTS;
+        worker->backlog_count--;
+    }
+
+    return due;
+}
+
+// Checks if the thread still has queries that may be answered
+int check_pending(Worker *worker) {
+    int i;
+
+    if (worker->backlog_count > 0) {
+        return 1;
+    }
+
+    for (i = 0; i < worker->socket_count; i++) {
+        if (worker->sockets[i].busy) {
+            return 1;
+        }
+    }
+
+    for (i = 0; !use_tcp && i < ID_SLOTS; i++) {
+        if (worker->sent[i]) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Sends queries at the thread's rate for the whole run, then waits a little
+// for late answers
+void *run_worker(void *param) {
+    Worker *worker = (Worker*)param;
+    long start = get_ns(), now = start, next = start, wait;
+    struct timespec timeout;
+    int i;
+
+    while (now < start + duration + DRAIN_TIME) {
+        next = send_due(worker, start, now);
+        if (next >= start + duration && !check_pending(worker)) {
+            break;
+        }
+
+        for (i = 0; i < worker->socket_count; i++) {
+            worker->fds[i].fd = worker->sockets[i].sockfd;
+            worker->fds[i].events = POLLIN;
+        }
+
+        wait = (next < start + duration ? next :
+            start + duration + DRAIN_TIME) - now;
+        timeout.tv_sec = wait > 0 ? wait / NS_PER_SEC : 0;
+        timeout.tv_nsec = wait > 0 ? wait % NS_PER_SEC : 0;
+
+        if (ppoll(worker->fds, worker->socket_count, &timeout, NULL) > 0) {
+            for (i = 0; i < worker->socket_count; i++) {
+                if (!(worker->fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                    continue;
+                }
+                if (use_tcp) {
+                    read_stream(worker, &worker->sockets[i]);
+                } else {
+                    read_datagrams(worker, &worker->sockets[i]);
+                }
+            }
+        }
+        now = get_ns();
+    }
+
+    // Whatever is still unanswered is lost
+    for (i = 0; i < worker->socket_count; i++) {
+        worker->lost += worker->sockets[i].busy;
+    }
+    worker->lost += worker->backlog_count;
+    for (i = 0; !use_tcp && i < ID_SLOTS; i++) {
+        worker->lost += worker->sent[i] != 0;
+    }
+
+    return NULL;
+}
+
+// Asks bench/fake_upstream how many queries it has answered, returns -1 if
+// it does not reply
+long get_upstream_count(int port) {
+    struct sockaddr_in addr;
+    struct pollfd fd;
+    unsigned char buffer[8] = {0};
+    long count = 0;
+    int i, sockfd;
+
+    if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    fd.fd = sockfd;
+    fd.events = POLLIN;
+    if (sendto(sockfd, buffer, 1, 0, (struct sockaddr*)&addr,
+        sizeof(addr)) < 0 || poll(&fd, 1, COUNT_TIMEOUT) <= 0 ||
+        recv(sockfd, buffer, sizeof(buffer), 0) != sizeof(buffer)) {
+        close(sockfd);
+        return -1;
+    }
+
+    for (i = 0; i < 8; i++) {
+        count = (count << 8) | buffer[i];
+    }
+    close(sockfd);
+
+    return count;
+}
+
+// Reads a captured message, skipping files that are not one whole message
+int load_query(const char *path, Query *query) {
+    unsigned char buffer[TCP_HEADER_SIZE + MAX_MSG_SIZE];
+    FILE *file = fopen(path, "rb");
+    int len, size;
+
+    if (!file) {
+        perror(path);
+        return -1;
+    }
+
+    len = fread(buffer, 1, sizeof(buffer), file);
+    fclose(file);
+
+    size = len >= TCP_HEADER_SIZE ? (buffer[0] << 8) | buffer[1] : -1;
+    if (size + TCP_HEADER_SIZE != len || size < HEADER_SIZE) {
+        return -1;
+    }
+
+    query->buffer = malloc(size);
+    assert(query->buffer);
+    memcpy(query->buffer, buffer + TCP_HEADER_SIZE, size);
+    query->size = size;
+
+    return 0;
+}
+
+// Orders two latencies for qsort
+int compare_latency(const void *a, const void *b) {
+    long x = *(const long*)a, y = *(const long*)b;
+
+    return (x > y) - (x < y);
+}
+
+// Gets the latency in us below which the given share of answers came
+double get_percentile(long *latencies, long count, double share) {
+    if (count == 0) {
+        return 0;
+    }
+
+    return (double)latencies[(long)((count - 1)*share)] / NS_PER_US;
+}
+
+int main(int argc, char *argv[]) {
+    long rate = 1000, sent = 0, lost = 0, count = 0, offset = 0;
+    long before = -1, after = -1, elapsed, forwarded;
+    int opt, i, j, threads = 1, connections = 1, upstream_port = 0;
+    struct addrinfo hints;
+    pthread_t thread_ids[MAX_THREADS];
+    Worker *workers = NULL;
+    long *latencies = NULL;
+
+    while ((opt = getopt(argc, argv, "r:c:t:d:Tu:")) != -1) {
+        switch (opt) {
+            case 'r':
+                rate = atol(optarg);
+                break;
+            case 'c':
+                connections = atoi(optarg);
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'd':
+                duration = atol(optarg)*NS_PER_SEC;
+                break;
+            case 'T':
+                use_tcp = 1;
+                break;
+            case 'u':
+                upstream_port = atoi(optarg);
+                break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+
+    if (argc - optind < 3 || rate <= 0 || threads < 1 ||
+        threads > MAX_THREADS || connections < threads ||
+        connections > threads*MAX_CONNECTIONS) {
+        fprintf(stderr, "usage: %s [-r rate] [-c connections] [-t threads] "
+            "[-d seconds] [-T] [-u upstream_port] ip port query.raw ...\n",
+            argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    hints.ai_socktype = use_tcp ? SOCK_STREAM : SOCK_DGRAM;
+    if (getaddrinfo(argv[optind], argv[optind + 1], &hints, &server) != 0) {
+        fprintf(stderr, "bad address %s %s\n", argv[optind],
+            argv[optind + 1]);
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = optind + 2; i < argc && query_count < MAX_QUERIES; i++) {
+        if (load_query(argv[i], &queries[query_count]) == 0) {
+            query_count++;
+        }
+    }
+    if (query_count == 0) {
+        fprintf(stderr, "no queries loaded\n");
+        exit(EXIT_FAILURE);
+    }
+
+    workers = calloc(threads, sizeof(Worker));
+    assert(workers);
+    for (i = 0; i < threads; i++) {
+        workers[i].index = i;
+        workers[i].interval = threads*NS_PER_SEC / rate;
+        workers[i].socket_count = connections / threads +
+            (i < connections % threads);
+        workers[i].sent = calloc(ID_SLOTS, sizeof(long));
+        workers[i].backlog = malloc(ID_SLOTS*sizeof(long));
+        workers[i].latency_size = rate*(duration / NS_PER_SEC) / threads + 1;
+        workers[i].latencies = malloc(workers[i].latency_size*sizeof(long));
+        assert(workers[i].sent && workers[i].backlog &&
+            workers[i].latencies);
+
+        // UDP sockets stay open, TCP connections open on their first query
+        for (j = 0; j < workers[i].socket_count; j++) {
+            workers[i].sockets[j].sockfd = -1;
+            workers[i].sockets[j].buffer =
+                malloc(TCP_HEADER_SIZE + MAX_MSG_SIZE);
+            assert(workers[i].sockets[j].buffer);
+            if (!use_tcp && open_socket(&workers[i].sockets[j]) < 0) {
+                perror("connect");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    if (upstream_port > 0) {
+        before = get_upstream_count(upstream_port);
+    }
+
+    elapsed = get_ns();
+    for (i = 0; i < threads; i++) {
+        pthread_create(&thread_ids[i], NULL, run_worker, &workers[i]);
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(thread_ids[i], NULL);
+    }
+    elapsed = get_ns() - elapsed;
+
+    if (upstream_port > 0) {
+        after = get_upstream_count(upstream_port);
+    }
+
+    // Merges the latencies of every thread
+    for (i = 0; i < threads; i++) {
+        sent += workers[i].queries_sent;
+        lost += workers[i].lost;
+        count += workers[i].latency_count;
+    }
+    latencies = malloc((count + 1)*sizeof(long));
+    assert(latencies);
+    for (i = 0; i < threads; i++) {
+        memcpy(latencies + offset, workers[i].latencies,
+            workers[i].latency_count*sizeof(long));
+        offset += workers[i].latency_count;
+    }
+    qsort(latencies, count, sizeof(long), compare_latency);
+
+    printf("sent %ld, answered %ld, lost %ld in %.2f s over %s\n", sent,
+        count, lost, (double)elapsed / NS_PER_SEC, use_tcp ? "TCP" : "UDP");
+    printf("QPS: %.0f\n", (double)count*NS_PER_SEC /
+        (elapsed < duration ? elapsed : duration));
+    printf("latency us: p50 %.1f, p99 %.1f, p999 %.1f, max %.1f\n",
+        get_percentile(latencies, count, 0.5),
+        get_percentile(latencies, count, 0.99),
+        get_percentile(latencies, count, 0.999),
+        get_percentile(latencies, count, 1));
+
+    if (before >= 0 && after >= 0 && count > 0) {
+        forwarded = after - before;
+        printf("cache hits: %.1f%% (%ld of %ld answers forwarded)\n",
+            forwarded < count ? 100.0*(count - forwarded) / count : 0.0,
+            forwarded, count);
+    } else if (upstream_port > 0) {
+        printf("cache hits: upstream count unavailable\n");
+    }
+
+    return 0;
+}
@@ -0,0 +1,562 @@
+// Times the hot paths of message.c, cache.c and the reply packing and raw
+// answers in server.c, counting the allocations each operation makes, and
+// compares them against a recorded baseline. Fails if any operation got
+// slower by more than the tolerance, or allocates more than it used to.
+//
+// Timings only compare on the machine the baseline was recorded on, so
+// record a new one with -w before relying on -b somewhere else.
+//
+// Usage: bench/microbench [-b baseline | -w baseline] [-t tolerance_percent]
+//            packets/*.raw
+
+#include <libgen.h>
+#include <getopt.h>
+
+#include "../server.h"
+
+#define ROUNDS 20000        // Operations per timed run
+#define CACHE_ROUNDS 1000   // Cache operations per run, logging less than fits
+#define SETTLE_US 10000     // Time given to the logger before each operation
+#define REPEATS 10          // Timed runs, the fastest is kept
+#define PASSES 3            // Times the suite is run before a regression counts
+#define MAX_RESULTS 256     // Most operations measured
+#define NAME_SIZE 96        // Longest operation name
+#define SINK_FD 1000000     // Descriptor whose writes land in the sink
+#define SINK_SIZE 65536     // Bytes kept by the sink
+#define QUERY_SEQ 4096      // Questions looked up in turn
+#define TOLERANCE 50        // Slowdown in percent allowed by default
+#define BENCH_HASH_KEY 0x0123456789abcdefULL    // Fixed, not drawn
+#define DATAGRAM_SIZE 512   // Reply size of a client without EDNS
+#define TEST_TTL 300        // Ttl of the answers made up for the cache
+#define LOG_NAME "dns_svr.log"  // Log opened by the logger, thrown away
+
+// Time and allocations of one operation
+typedef struct {
+    char name[NAME_SIZE];
+    double ns;
+    double allocs;
+
+    // Slowest of the passes, recorded as the baseline so a lucky pass does
+    // not make every later run look slow
+    double slow_ns;
+} Result;
+
+// Called for the i-th operation of a run
+typedef void (*Bench_Op)(void *arg, long i);
+
+// Cache and the messages an operation goes through, with an event loop
+// holding the cache for the server's own paths
+typedef struct {
+    Cache *cache;
+    Message **msgs;
+    int count;
+    Properties *prop;
+} Cache_Bench;
+
+// Fastest time of each operation over the passes so far
+static Result results[MAX_RESULTS];
+static int result_count = 0;
+static int pass = 0;
+
+// Recorded results compared against, if any
+static Result base[MAX_RESULTS];
+static int base_count = 0;
+
+// Allocations made by the calling thread, so the logger is not counted
+static __thread long alloc_calls = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+FILE *__real_fopen(const char *path, const char *mode);
+
+// Counts the call and forwards it to the real malloc
+void *__wrap_malloc(size_t size) {
+    alloc_calls++;
+    return __real_malloc(size);
+}
+
+// Counts the call and forwards it to the real calloc
+void *__wrap_calloc(size_t nmemb, size_t size) {
+    alloc_calls++;
+    return __real_calloc(nmemb, size);
+}
+
+// Counts the call and forwards it to the real realloc
+void *__wrap_realloc(void *ptr, size_t size) {
+    alloc_calls++;
+    return __real_realloc(ptr, size);
+}
+
+// Copies writes to the sink into memory, forwarding the rest
+ssize_t __wrap_write(int fd, const void *buf, size_t count) {
+    static unsigned char sink[SINK_SIZE];
+
+    if (fd != SINK_FD) {
+        return __real_write(fd, buf, count);
+    }
+
+    memcpy(sink, buf, count < SINK_SIZE ? count : SINK_SIZE);
+    return count;
+}
+
+// Opens files as asked, except the log which is thrown away
+FILE *__wrap_fopen(const char *path, const char *mode) {
+    return __real_fopen(strcmp(path, LOG_NAME) ? path : "/dev/null", mode);
+}
+
+// Gets the current time in nanoseconds
+double get_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+// Runs the operation rounds times, returns the time of each in ns
+double time_op(Bench_Op op, void *arg, long rounds) {
+    double start = get_ns();
+    long i;
+
+    for (i = 0; i < rounds; i++) {
+        op(arg, i);
+    }
+
+    return (get_ns() - start)/rounds;
+}
+
+// Times the operation over several runs after an untimed one, keeping the
+// fastest of every pass
+void run_bench(const char *name, Bench_Op op, void *arg, long rounds) {
+    Result *result = &results[result_count];
+    double ns, pass_ns = -1;
+    long start_allocs;
+    int j;
+
+    if (result_count == MAX_RESULTS) {
+        return;
+    }
+    result_count++;
+
+    if (pass == 0) {
+        snprintf(result->name, NAME_SIZE, "%s", name);
+        result->ns = -1;
+        result->slow_ns = -1;
+    }
+
+    // Lines logged for the last operation are not written during this one
+    usleep(SETTLE_US);
+
+    for (j = 0; j <= REPEATS; j++) {
+        start_allocs = alloc_calls;
+        ns = time_op(op, arg, rounds);
+        result->allocs = (double)(alloc_calls - start_allocs)/rounds;
+
+        // The first run only warms the caches
+        if (j > 0 && (pass_ns < 0 || ns < pass_ns)) {
+            pass_ns = ns;
+        }
+    }
+
+    if (result->ns < 0 || pass_ns < result->ns) {
+        result->ns = pass_ns;
+    }
+    if (pass_ns > result->slow_ns) {
+        result->slow_ns = pass_ns;
+    }
+}
+
+// Copies and indexes a captured message
+void bench_create(void *arg, long i) {
+    Message *msg = (Message*)arg;
+
+    free_msg(create_msg(msg->buffer, msg->size));
+}
+
+// Builds and hashes the cache key of the message's question
+void bench_key(void *arg, long i) {
+    static unsigned char key[KEY_SIZE];
+    Message *msg = (Message*)arg;
+
+    hash_key(key, make_key(msg, key));
+}
+
+// Copies a captured message and compresses its names
+void bench_compress(void *arg, long i) {
+    Message *msg = (Message*)arg;
+
+    free_msg(compress_msg(copy_msg(msg)));
+}
+
+// Packs a reply with its TCP prefix and writes it to the sink
+void bench_send(void *arg, long i) {
+    static unsigned char buffer[TCP_HEADER_SIZE + MAX_MSG_SIZE];
+    Message *msg = (Message*)arg;
+    int len = pack_reply(msg, buffer), bytes_written = 0;
+
+    write_to_sock(SINK_FD, buffer, len, &bytes_written);
+}
+
+// Packs a reply for a client that takes datagrams without EDNS
+void bench_datagram(void *arg, long i) {
+    static unsigned char buffer[MAX_MSG_SIZE];
+    Message *msg = (Message*)arg;
+
+    pack_datagram(msg->buffer, msg->size, msg->qn_end, DATAGRAM_SIZE, buffer);
+}
+
+// Looks up the next question of the sequence
+void bench_lookup(void *arg, long i) {
+    Cache_Bench *bench = (Cache_Bench*)arg;
+    unsigned char *buffer = NULL;
+    int len;
+
+    buffer = lookup(bench->cache, bench->msgs[i % bench->count], 0, &len);
+    free(buffer);
+}
+
+// Answers the next question of the sequence from its wire bytes, as the
+// server does before indexing a query
+void bench_answer(void *arg, long i) {
+    Cache_Bench *bench = (Cache_Bench*)arg;
+    Message *msg = bench->msgs[i % bench->count];
+    Raw_Answer raw;
+
+    if (answer_raw(bench->prop, msg->buffer, msg->size, 0, &raw) > 0) {
+        free(raw.reply);
+    }
+}
+
+// Caches the next answer, replacing the least recently used once full
+void bench_insert(void *arg, long i) {
+    Cache_Bench *bench = (Cache_Bench*)arg;
+
+    cache_item(bench->cache, bench->msgs[i % bench->count]);
+}
+
+// Makes up a question for AAAA of a name numbered index, with its answer if
+// asked
+Message *make_msg(int index, int answer) {
+    unsigned char buffer[HEADER_SIZE + DOMAIN_LEN + 32];
+    char label[16];
+    int pos = HEADER_SIZE, len;
+
+    memset(buffer, 0, HEADER_SIZE);
+    put_two_bytes(buffer, FLAGS_OFF, answer ? 0x8180 : 0x0100);
+    put_two_bytes(buffer, QDCOUNT_OFF, 1);
+    put_two_bytes(buffer, ANCOUNT_OFF, answer);
+
+    len = snprintf(label, sizeof(label), "k%d", index);
+    buffer[pos++] = len;
+    memcpy(buffer + pos, label, len);
+    pos += len;
+    buffer[pos++] = 5;
+    memcpy(buffer + pos, "bench", 5);
+    pos += 5;
+    buffer[pos++] = 0;
+    put_two_bytes(buffer, pos, 28);
+    put_two_bytes(buffer, pos + 2, 1);
+    pos += 4;
+
+    // Owner name points back at the question
+    if (answer) {
+        put_two_bytes(buffer, pos, 0xc000 | HEADER_SIZE);
+        put_two_bytes(buffer, pos + 2, 28);
+        put_two_bytes(buffer, pos + 4, 1);
+        put_four_bytes(buffer, pos + 6, TEST_TTL);
+        put_two_bytes(buffer, pos + 10, IPv6_SIZE);
+        memset(buffer + pos + 12, index & 0xff, IPv6_SIZE);
+        pos += 12 + IPv6_SIZE;
+    }
+
+    return create_msg(buffer, pos);
+}
+
+// Fills a cache of the given size with answers to the first size names
+Cache *fill_cache(int size) {
+    Cache *cache = create_cache(size, 0);
+    Message *msg = NULL;
+    int i;
+
+    for (i = 0; i < size; i++) {
+        msg = make_msg(i, 1);
+        cache_item(cache, msg);
+        free_msg(msg);
+    }
+
+    return cache;
+}
+
+// Times lookups in a full cache of the given size, where hit percent of the
+// questions have an answer cached
+void bench_lookups(int size, int hit) {
+    Cache_Bench bench;
+    char name[NAME_SIZE];
+    int i, names = size*100/hit;
+    unsigned int seed = 1;
+
+    bench.cache = fill_cache(size);
+
+    // The same pseudo-random questions every run
+    bench.count = QUERY_SEQ;
+    bench.msgs = malloc(QUERY_SEQ*sizeof(Message*));
+    assert(bench.msgs);
+    for (i = 0; i < QUERY_SEQ; i++) {
+        seed = seed*1103515245 + 12345;
+        bench.msgs[i] = make_msg((seed >> 8) % names, 0);
+    }
+
+    snprintf(name, NAME_SIZE, "lookup/%d/%d%%", size, hit);
+    run_bench(name, bench_lookup, &bench, CACHE_ROUNDS);
+
+    // Statistics only, so an event loop that never runs will do
+    bench.prop = calloc(1, sizeof(Properties));
+    assert(bench.prop);
+    bench.prop->cache = bench.cache;
+    snprintf(name, NAME_SIZE, "answer_raw/%d/%d%%", size, hit);
+    run_bench(name, bench_answer, &bench, CACHE_ROUNDS);
+    free(bench.prop);
+
+    for (i = 0; i < bench.count; i++) {
+        free_msg(bench.msgs[i]);
+    }
+    free(bench.msgs);
+    free_cache(bench.cache);
+}
+
+// Times caching answers into a full cache of the given size
+void bench_inserts(int size) {
+    Cache_Bench bench;
+    char name[NAME_SIZE];
+    int i;
+
+    bench.cache = fill_cache(size);
+
+    // Twice as many answers as fit, so every insert evicts another
+    bench.count = 2*size;
+    bench.msgs = malloc(bench.count*sizeof(Message*));
+    assert(bench.msgs);
+    for (i = 0; i < bench.count; i++) {
+        bench.msgs[i] = make_msg(size + i, 1);
+    }
+
+    snprintf(name, NAME_SIZE, "cache_item/%d", size);
+    run_bench(name, bench_insert, &bench, CACHE_ROUNDS);
+
+    for (i = 0; i < bench.count; i++) {
+        free_msg(bench.msgs[i]);
+    }
+    free(bench.msgs);
+    free_cache(bench.cache);
+}
+
+// Reads a captured message, skipping files that are not one whole message
+Message *load_msg(const char *path) {
+    static unsigned char buffer[TCP_HEADER_SIZE + MAX_MSG_SIZE];
+    FILE *file = fopen(path, "rb");
+    int len, size;
+
+    if (!file) {
+        perror(path);
+        return NULL;
+    }
+
+    len = fread(buffer, 1, sizeof(buffer), file);
+    fclose(file);
+
+    size = len >= TCP_HEADER_SIZE ? (buffer[0] << 8) | buffer[1] : -1;
+    if (size + TCP_HEADER_SIZE != len) {
+        return NULL;
+    }
+
+    return create_msg(buffer + TCP_HEADER_SIZE, size);
+}
+
+// Writes the results as the new baseline
+void write_baseline(const char *path) {
+    FILE *file = fopen(path, "w");
+    int i;
+
+    if (!file) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(file, "# operation ns allocs\n");
+    for (i = 0; i < result_count; i++) {
+        fprintf(file, "%s %.1f %.2f\n", results[i].name,
+            results[i].slow_ns, results[i].allocs);
+    }
+    fclose(file);
+}
+
+// Reads the baseline recorded with -w
+void load_baseline(const char *path) {
+    FILE *file = fopen(path, "r");
+    char line[NAME_SIZE*2];
+
+    if (!file) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    while (base_count < MAX_RESULTS && fgets(line, sizeof(line), file)) {
+        if (line[0] != '#' && sscanf(line, "%95s %lf %lf",
+            base[base_count].name, &base[base_count].ns,
+            &base[base_count].allocs) == 3) {
+            base_count++;
+        }
+    }
+    fclose(file);
+}
+
+// Finds the baseline of an operation, or NULL if it is new
+Result *find_base(Result *result) {
+    int i;
+
+    for (i = 0; i < base_count; i++) {
+        if (strcmp(base[i].name, result->name) == 0) {
+            return &base[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Checks if the operation got slower or allocates more than its baseline.
+// Allocation counts do not vary between runs, so any rise counts
+int check_regressed(Result *result, double tolerance) {
+    Result *found = find_base(result);
+
+    return found && (result->ns > found->ns*(1 + tolerance/100) ||
+        result->allocs > found->allocs + 0.005);
+}
+
+// Counts the operations that regressed
+int count_regressions(double tolerance) {
+    int i, regressions = 0;
+
+    for (i = 0; i < result_count; i++) {
+        regressions += check_regressed(&results[i], tolerance);
+    }
+
+    return regressions;
+}
+
+// Prints the results, next to the baseline if there is one
+void print_results(double tolerance) {
+    Result *found = NULL;
+    int i;
+
+    printf("%-48s %10s %8s %10s %8s\n", "operation", "ns", "allocs",
+        "base ns", "change");
+    for (i = 0; i < result_count; i++) {
+        printf("%-48s %10.1f %8.2f", results[i].name, results[i].ns,
+            results[i].allocs);
+
+        if (!(found = find_base(&results[i]))) {
+            printf(" %10s %8s\n", "-", base_count > 0 ? "new" : "-");
+            continue;
+        }
+
+        printf(" %10.1f %+7.0f%%%s\n", found->ns,
+            100*(results[i].ns - found->ns)/found->ns,
+            check_regressed(&results[i], tolerance) ? "  REGRESSED" : "");
+    }
+}
+
+// Times every operation once more, on the captured messages and made up
+// caches
+void run_suite(int path_count, char *paths[]) {
+    static const int sizes[] = {16, 1024, 65536}, hits[] = {100, 90, 50};
+    char name[NAME_SIZE], *file = NULL;
+    Message *msg = NULL;
+    int i, j;
+
+    result_count = 0;
+
+    for (i = 0; i < path_count; i++) {
+        if (!(msg = load_msg(paths[i]))) {
+            continue;
+        }
+        file = basename(paths[i]);
+
+        snprintf(name, NAME_SIZE, "create_msg/%s", file);
+        run_bench(name, bench_create, msg, ROUNDS);
+        if (msg->qn_count > 0) {
+            snprintf(name, NAME_SIZE, "make_key/%s", file);
+            run_bench(name, bench_key, msg, ROUNDS);
+        }
+        if (msg->rr_count > 0) {
+            snprintf(name, NAME_SIZE, "compress_msg/%s", file);
+            run_bench(name, bench_compress, msg, ROUNDS);
+        }
+        snprintf(name, NAME_SIZE, "pack_reply/%s", file);
+        run_bench(name, bench_send, msg, ROUNDS);
+        snprintf(name, NAME_SIZE, "pack_datagram/%s", file);
+        run_bench(name, bench_datagram, msg, ROUNDS);
+
+        free_msg(msg);
+    }
+
+    for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+        for (j = 0; j < sizeof(hits)/sizeof(hits[0]); j++) {
+            bench_lookups(sizes[i], hits[j]);
+        }
+    }
+    for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+        bench_inserts(sizes[i]);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *record = NULL;
+    double tolerance = TOLERANCE;
+    int opt, regressions = 0;
+
+    while ((opt = getopt(argc, argv, "b:w:t:")) != -1) {
+        switch (opt) {
+            case 'b':
+                load_baseline(optarg);
+                break;
+            case 'w':
+                record = optarg;
+                break;
+            case 't':
+                tolerance = atof(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-b baseline | -w baseline] "
+                    "[-t tolerance_percent] message.raw ...\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    // Caches evict the same items on every run, so allocations compare
+    set_hash_key(BENCH_HASH_KEY, BENCH_HASH_KEY);
+
+    // Cache hits are logged as the server would, to nowhere
+    start_logger();
+
+    // A busy machine makes any one pass slow, code that got slower stays
+    // slow on every pass. Recording runs them all
+    for (pass = 0; pass < PASSES; pass++) {
+        run_suite(argc - optind, argv + optind);
+        regressions = count_regressions(tolerance);
+        if (!record && (base_count == 0 || regressions == 0)) {
+            break;
+        }
+    }
+
+    if (record) {
+        write_baseline(record);
+    }
+    print_results(tolerance);
+
+    if (regressions > 0) {
+        fprintf(stderr, "%d operations regressed\n", regressions);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,149 @@
+// Compares the system calls and time taken to send each captured message
+// field by field, as replies used to be sent, against a single buffer.
+//
+// Usage: bench/send_bench packets/*.raw
+
+#include <sys/time.h>
+
+#include "../server.h"
+
+#define ROUNDS 10000        // Times each message is sent per method
+#define SINK_SIZE 65536     // Bytes drained from the sink at a time
+
+// Counts every write made by the benchmark and the server code it calls
+static long write_calls = 0;
+
+ssize_t __real_write(int fd, const void *buf, size_t count);
+
+// Counts the call and forwards it to the real write
+ssize_t __wrap_write(int fd, const void *buf, size_t count) {
+    write_calls++;
+    return __real_write(fd, buf, count);
+}
+
+// Sends a message with one write per field, as send_msg used to
+void send_fields(const int sockfd, Message *msg) {
+    unsigned char *buffer = msg->buffer;
+    u_int16_t tcp_hdr = htons(msg->size);
+    Name *name = &msg->qn.name;
+    Record *rr = NULL;
+    int i, end;
+
+    write(sockfd, &tcp_hdr, sizeof(tcp_hdr));
+
+    // Header fields
+    for (i = 0; i < HEADER_SIZE; i += 2) {
+        write(sockfd, buffer + i, 2);
+    }
+
+    // Length and text of each label, then the zero byte
+    for (i = 0; i < name->label_count; i++) {
+        write(sockfd, buffer + name->label_off[i], 1);
+        write(sockfd, buffer + name->label_off[i] + 1,
+            buffer[name->label_off[i]]);
+    }
+    write(sockfd, buffer + name->off + name->len - 1, 1);
+    write(sockfd, buffer + name->off + name->len, 2);
+    write(sockfd, buffer + name->off + name->len + 2, 2);
+
+    for (i = 0; i < msg->ans_count && i < msg->rr_count; i++) {
+        rr = &msg->rr_list[i];
+        write(sockfd, buffer + rr->off, rr->ttl_off - 4 - rr->off);
+        write(sockfd, buffer + rr->ttl_off - 4, 2);
+        write(sockfd, buffer + rr->ttl_off - 2, 2);
+        write(sockfd, buffer + rr->ttl_off, 4);
+        write(sockfd, buffer + rr->ttl_off + 4, 2);
+        write(sockfd, buffer + rr->rdata_off, rr->rdata_len);
+    }
+
+    // Everything after the answers went out as one block
+    end = rr ? rr->rdata_off + rr->rdata_len : msg->qn_end;
+    write(sockfd, buffer + end, msg->size - end);
+}
+
+// Sends a message as one buffer, as replies are sent now
+void send_buffer(const int sockfd, Message *msg) {
+    static unsigned char buffer[TCP_HEADER_SIZE + MAX_MSG_SIZE];
+    int len = pack_reply(msg, buffer), bytes_written = 0;
+
+    while (write_to_sock(sockfd, buffer, len, &bytes_written) == 0);
+}
+
+// Gets the current time in nanoseconds
+double get_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+// Sends the message repeatedly with the given method, draining the sink
+void run_method(void (*send)(const int, Message*), Message *msg, int fds[2],
+    double *ns, double *calls) {
+    static unsigned char sink[SINK_SIZE];
+    long start_calls = write_calls;
+    double start = get_ns();
+    int i;
+
+    for (i = 0; i < ROUNDS; i++) {
+        send(fds[0], msg);
+        while (read(fds[1], sink, SINK_SIZE) > 0);
+    }
+
+    *ns = (get_ns() - start)/ROUNDS;
+    *calls = (double)(write_calls - start_calls)/ROUNDS;
+}
+
+// Reads a captured message, skipping files that are not one whole message
+Message *load_msg(const char *path) {
+    static unsigned char buffer[TCP_HEADER_SIZE + MAX_MSG_SIZE];
+    FILE *file = fopen(path, "rb");
+    int len, size;
+
+    if (!file) {
+        perror(path);
+        return NULL;
+    }
+
+    len = fread(buffer, 1, sizeof(buffer), file);
+    fclose(file);
+
+    size = len >= TCP_HEADER_SIZE ? (buffer[0] << 8) | buffer[1] : -1;
+    if (size + TCP_HEADER_SIZE != len) {
+        return NULL;
+    }
+
+    return create_msg(buffer + TCP_HEADER_SIZE, size);
+}
+
+int main(int argc, char *argv[]) {
+    double field_ns, field_calls, buffer_ns, buffer_calls;
+    Message *msg = NULL;
+    int i, fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+    set_nonblocking(fds[1]);
+
+    printf("%-40s %12s %12s %12s %12s\n", "message", "field calls",
+        "field ns", "buffer calls", "buffer ns");
+
+    for (i = 1; i < argc; i++) {
+        if (!(msg = load_msg(argv[i]))) {
+            continue;
+        }
+
+        run_method(send_fields, msg, fds, &field_ns, &field_calls);
+        run_method(send_buffer, msg, fds, &buffer_ns, &buffer_calls);
+
+        printf("%-40s %12.0f %12.0f %12.0f %12.0f\n", argv[i], field_calls,
+            field_ns, buffer_calls, buffer_ns);
+        free_msg(msg);
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+
+    return 0;
+}
@@ -1,14 +1,59 @@
 #include "cache.h"
 
-#define CACHE_LIMIT 5   // Maximum items allowed in cache
+#define CACHE_SHARDS 16         // Shards of a cache large enough to split
+#define MIN_SHARD_ITEMS 64      // Smallest capacity worth its own shard
+#define REFRESH_HITS 8          // Hits making an item worth refreshing
+#define REFRESH_SHARE 10        // Refreshed in the last 1/10 of its lifetime
+#define STALE_TTL 30            // Ttl of expired answers served (RFC 8767)
+#define NOERROR 0               // Rcode of a successful response
+#define NXDOMAIN 3              // Rcode of a response for a missing name
+#define SOA_MIN_RDATA 22        // Two root names and five 32-bit fields
 
-// Creates an empty cache
-Cache *create_cache() {
+// Creates an empty cache holding up to capacity items, which are kept for
+// grace seconds after they expire
+Cache *create_cache(unsigned int capacity, time_t grace) {
     Cache *cache = malloc(sizeof(*cache));
+    Cache_Shard *shard = NULL;
+    unsigned int i;
+
     assert(cache);
 
-    cache->item = NULL;
-    cache->item_count = 0; // Initialise to empty
+    // Small caches stay whole so eviction follows one LRU list
+    cache->shard_count = capacity >= CACHE_SHARDS*MIN_SHARD_ITEMS ?
+        CACHE_SHARDS : 1;
+    cache->shards = malloc(cache->shard_count*sizeof(Cache_Shard));
+    assert(cache->shards);
+
+    for (i = 0; i < cache->shard_count; i++) {
+        shard = &cache->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+
+        shard->capacity = (capacity + cache->shard_count - 1) /
+            cache->shard_count;
+        shard->item_count = 0; // Initialise to empty
+        shard->lru_head = NULL;
+        shard->lru_tail = NULL;
+
+        // At most one item per bucket on average, masked instead of divided
+        shard->bucket_count = 1;
+        while (shard->bucket_count < shard->capacity) {
+            shard->bucket_count <<= 1;
+        }
+
+        shard->buckets = calloc(shard->bucket_count, sizeof(Cache_Item*));
+        assert(shard->buckets);
+        shard->swept = calloc(shard->bucket_count, sizeof(u_int32_t));
+        assert(shard->swept);
+
+        init_wheel(&shard->wheel, get_coarse_time());
+        shard->grace = grace;
+    }
+
+    atomic_init(&cache->swept, get_coarse_time());
+    cache->grace = grace;
+    atomic_init(&cache->evictions, 0);
+    cache->refresh = NULL;
+    cache->refresh_arg = NULL;
 
     return cache;
 }
@@ -17,145 +62,491 @@ Cache *create_cache() {
 Cache_Item *create_item(Message *msg) {
     Cache_Item *item = malloc(sizeof(*item));
     assert(item);
-    time_t current;
-    time(&current);
 
     item->msg = msg;
-    // Use ttl of first answer
-    item->expiry = current + ntohl(msg->ans_list[0]->ttl);
-    item->next_item = NULL;
+    // Lives as long as its shortest lived answer
+    item->stored = get_coarse_time();
+    item->expiry = item->stored + get_min_ttl(msg);
+
+    // Clients are told how long the negative answer holds by its SOA
+    if (msg->ans_count == 0) {
+        set_ttl(msg, find_soa(msg), item->expiry - item->stored);
+    }
+    item->key_len = make_key(msg, item->key);
+    item->hash = hash_key(item->key, item->key_len);
+    atomic_init(&item->referenced, 0);
+    atomic_init(&item->hits, 0);
+    atomic_init(&item->refreshing, 0);
+    atomic_init(&item->next_item, NULL);
+    item->prev_used = NULL;
+    item->next_used = NULL;
+    item->timer.owner = item;
+    item->timer.pprev = NULL;
 
     return item;
 }
 
-// Adds a message into the cache
+// Adds a copy of a message into the cache
 void cache_item(Cache *cache, Message *msg) {
-    Cache_Item *item = cache->item, *new_item = create_item(msg);
+    Cache_Item *new_item = create_item(copy_msg(msg)), *item = NULL;
+    Cache_Shard *shard = get_shard(cache, new_item->hash);
+    u_int32_t *swept = NULL;
+    int replaced = 0, resumed = 0;
+    time_t current = get_coarse_time();
 
-    if (!item) {
-        // Add item to first pos of cache
-        cache->item = new_item;
-        cache->item_count++;
-        return;
-    } else if (check_expired(item)) {
-        // Replace first item of cache
-        log_replace(cache->item->msg, msg);
-        free_item(cache->item);
-        cache->item = new_item;
+    pthread_mutex_lock(&shard->lock);
+    swept = &shard->swept[new_item->hash & (shard->bucket_count - 1)];
+    if (*swept == new_item->hash) {
+        // Replaces an answer to the same question the sweep already removed
+        resumed = 1;
+        *swept = 0;
+    }
+
+    if ((item = find_item(shard, new_item->key, new_item->key_len,
+        new_item->hash))) {
+        // Replaces the old answer to the same question
+        replaced = check_expired(item, current);
+        unlink_item(shard, item);
+    } else if (shard->item_count == shard->capacity) {
+        // Replaces the least recently used item
+        item = choose_victim(shard);
+        replaced = 1;
+        atomic_fetch_add_explicit(&cache->evictions, 1,
+            memory_order_relaxed);
+        unlink_item(shard, item);
+    }
+    link_item(shard, new_item);
+    pthread_mutex_unlock(&shard->lock);
+
+    if (resumed) {
+        log_replace(msg, msg);
+    }
+    if (replaced) {
+        log_replace(item->msg, msg);
+    }
+
+    // Readers may still be copying the old item
+    if (item) {
+        retire_ptr(item, free_retired);
+    }
+}
+
+// Searches the cache for a message and copies the answer into a new buffer
+// after headroom bytes, with the query's ID and aged ttls
+unsigned char *lookup(Cache *cache, Message *msg, int headroom, int *len) {
+    unsigned char key[KEY_SIZE];
+    int key_len = make_key(msg, key);
+
+    return lookup_key(cache, key, key_len, hash_key(key, key_len),
+        get_id(msg), msg->buffer + msg->qn.name.off, headroom, len);
+}
+
+// Searches the cache for the question with the given key and copies the
+// answer into a new buffer after headroom bytes, with the given ID, the name
+// as it was asked and aged ttls
+unsigned char *lookup_key(Cache *cache, unsigned char *key, int key_len,
+    u_int32_t hash, u_int16_t id, unsigned char *name, int headroom,
+    int *len) {
+    Cache_Item *item = NULL;
+    unsigned char *buffer = NULL;
+    time_t current = get_coarse_time();
+
+    // Items found while in the epoch stay allocated until it is left
+    enter_epoch();
+    item = find_item(get_shard(cache, hash), key, key_len, hash);
+    if (item && !check_expired(item, current)) {
+        if (!atomic_load_explicit(&item->referenced, memory_order_relaxed)) {
+            atomic_store_explicit(&item->referenced, 1,
+                memory_order_relaxed);
+        }
+
+        // The cached bytes are sent as they are, only patched in the copy
+        *len = item->msg->size;
+        buffer = malloc(headroom + *len);
+        assert(buffer);
+        memcpy(buffer + headroom, item->msg->buffer, *len);
+        put_two_bytes(buffer + headroom, ID_OFF, id);
+
+        // Echoes the question as asked, the key matched it ignoring case
+        memcpy(buffer + headroom + item->msg->qn.name.off, name,
+            item->msg->qn.name.len);
+        age_answer(item->msg, buffer + headroom, current - item->stored);
+
+        log_found(item->msg, item->expiry);
+
+        // Negative answers and ones leading with an alias have no address
+        // to log
+        if (item->msg->ans_count > 0 && item->msg->rr_list[0].type == AAAA) {
+            log_result(item->msg);
+        }
+
+        // Fetched again before it expires, while clients are still served
+        if (cache->refresh && check_refresh(item, current)) {
+            cache->refresh(cache->refresh_arg, item->msg);
+        }
+    }
+    exit_epoch();
+
+    return buffer;
+}
+
+// Searches the cache for a message, including answers that expired within
+// the grace window, and returns a copy of the answer
+Message *lookup_stale(Cache *cache, Message *msg) {
+    Cache_Item *item = NULL;
+    Message *stale = NULL;
+    unsigned char key[KEY_SIZE];
+    int key_len = make_key(msg, key), expired = 0, i;
+    u_int32_t hash = hash_key(key, key_len);
+    time_t current = get_coarse_time(), stored = 0;
+
+    enter_epoch();
+    item = find_item(get_shard(cache, hash), key, key_len, hash);
+    if (item && current <= item->expiry + cache->grace) {
+        stale = copy_msg(item->msg);
+        stored = item->stored;
+        expired = check_expired(item, current);
+    }
+    exit_epoch();
+
+    if (!stale) {
+        return NULL;
+    } else if (!expired) {
+        age_answer(stale, stale->buffer, current - stored);
+        return stale;
+    }
+
+    // Expired answers are only vouched for a short while
+    for (i = 0; i < stale->rr_count; i++) {
+        if (stale->rr_list[i].type != OPT) {
+            set_ttl(stale, i, STALE_TTL);
+        }
+    }
+
+    return stale;
+}
+
+// Removes the items that expired since the last sweep, at most once a
+// second
+void expire_cache(Cache *cache) {
+    Cache_Shard *shard = NULL;
+    Cache_Item *item = NULL;
+    Timer *timer = NULL, *expired = NULL;
+    time_t current = get_coarse_time(), swept = atomic_load(&cache->swept);
+    unsigned int i;
+
+    // Only the loop that claims this second sweeps
+    if (current <= swept ||
+        !atomic_compare_exchange_strong(&cache->swept, &swept, current)) {
         return;
     }
 
-    while (item) {
-        if (item->next_item && check_expired(item->next_item)) {
-            // Replace next item if expired
-            log_replace(item->next_item->msg, msg);
-            new_item->next_item = item->next_item->next_item;
-            free_item(item->next_item);
-            item->next_item = new_item;
-            return;
-        } else if (!item->next_item) {
-            if (cache->item_count == CACHE_LIMIT) {
-                // Replace first item
-                log_replace(cache->item->msg, msg);
-                pop_cache(cache);
-            } else {
-                // cache size < 5
-                cache->item_count++;
-            }
-            item->next_item = new_item;
-            return;
+    for (i = 0; i < cache->shard_count; i++) {
+        shard = &cache->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        expired = advance_wheel(&shard->wheel, current);
+        for (timer = expired; timer; timer = timer->next) {
+            item = (Cache_Item*)timer->owner;
+            shard->swept[item->hash & (shard->bucket_count - 1)] = item->hash;
+            unlink_item(shard, item);
+        }
+        pthread_mutex_unlock(&shard->lock);
+
+        // Readers may still be copying the expired items
+        while ((timer = expired)) {
+            expired = timer->next;
+            retire_ptr(timer->owner, free_retired);
         }
-        item = item->next_item;
     }
 }
 
-// Pops the first item from the cache
-void pop_cache(Cache *cache) {
-    Cache_Item *item = cache->item->next_item;
-    free_item(cache->item);
-    cache->item = item;
+// Gets the shard holding the keys with the given hash
+Cache_Shard *get_shard(Cache *cache, u_int32_t hash) {
+    // High bits pick the shard, low bits the bucket within it
+    return &cache->shards[(hash >> 28) % cache->shard_count];
 }
 
-// Searches the cache for a message
-Message *lookup(Cache *cache, Message *msg) {
-    Cache_Item *item = cache->item;
-    time_t current;
-    time(&current);
+// Finds the item answering the question with the given key
+Cache_Item *find_item(Cache_Shard *shard, unsigned char *key, int key_len,
+    u_int32_t hash) {
+    Cache_Item *item = atomic_load_explicit(
+        &shard->buckets[hash & (shard->bucket_count - 1)],
+        memory_order_acquire);
 
     while (item) {
-        // Checks if not expired and if first (only one) question match
-        if (!check_expired(item) &&
-        check_qn(item->msg->qn_list[0], msg->qn_list[0])) {
-            // Adjusts the ttl of the first (only one) answer
-            item->msg->ans_list[0]->ttl = htonl((unsigned int)difftime(
-                item->expiry, current));
-            log_found(item->msg, item->expiry);
-            return item->msg;
+        if (item->hash == hash && item->key_len == key_len &&
+            !memcmp(item->key, key, key_len)) {
+            return item;
         }
-        item = item->next_item;
+        item = atomic_load_explicit(&item->next_item, memory_order_acquire);
     }
 
     return NULL;
 }
 
-// Checks if item is expired
-int check_expired(Cache_Item *item) {
-    time_t current;
-    time(&current);
+// Removes the item from its bucket and from the LRU list
+void unlink_item(Cache_Shard *shard, Cache_Item *item) {
+    Cache_Item *_Atomic *link = &shard->buckets[item->hash &
+        (shard->bucket_count - 1)];
+
+    remove_timer(&item->timer);
+
+    while (atomic_load_explicit(link, memory_order_relaxed) != item) {
+        link = &atomic_load_explicit(link, memory_order_relaxed)->next_item;
+    }
+
+    // The item keeps its own link so readers standing on it can go on
+    atomic_store_explicit(link, atomic_load_explicit(&item->next_item,
+        memory_order_relaxed), memory_order_release);
+
+    if (item->prev_used) {
+        item->prev_used->next_used = item->next_used;
+    } else {
+        shard->lru_head = item->next_used;
+    }
+    if (item->next_used) {
+        item->next_used->prev_used = item->prev_used;
+    } else {
+        shard->lru_tail = item->prev_used;
+    }
+
+    shard->item_count--;
+}
 
+// Adds the item to its bucket and to the front of the LRU list
+void link_item(Cache_Shard *shard, Cache_Item *item) {
+    Cache_Item *_Atomic *bucket = &shard->buckets[item->hash &
+        (shard->bucket_count - 1)];
+
+    // Published only once fully written
+    atomic_store_explicit(&item->next_item,
+        atomic_load_explicit(bucket, memory_order_relaxed),
+        memory_order_relaxed);
+    atomic_store_explicit(bucket, item, memory_order_release);
+
+    item->prev_used = NULL;
+    item->next_used = shard->lru_head;
+    if (shard->lru_head) {
+        shard->lru_head->prev_used = item;
+    } else {
+        shard->lru_tail = item;
+    }
+    shard->lru_head = item;
+
+    add_timer(&shard->wheel, &item->timer, item->expiry + shard->grace + 1);
+
+    shard->item_count++;
+}
+
+// Chooses the item to evict, moving recently read items to the front of
+// the LRU list instead
+Cache_Item *choose_victim(Cache_Shard *shard) {
+    Cache_Item *item = shard->lru_tail;
+
+    // Readers only mark what they used, so the list is reordered here
+    while (atomic_exchange_explicit(&item->referenced, 0,
+        memory_order_relaxed) && item != shard->lru_head) {
+        shard->lru_tail = item->prev_used;
+        shard->lru_tail->next_used = NULL;
+
+        item->prev_used = NULL;
+        item->next_used = shard->lru_head;
+        shard->lru_head->prev_used = item;
+        shard->lru_head = item;
+
+        item = shard->lru_tail;
+    }
+
+    return item;
+}
+
+// Checks if item is expired
+int check_expired(Cache_Item *item, time_t current) {
     if (difftime(item->expiry, current) < 0) {
         return 1;
     }
     return 0;
 }
 
-// Checks if qn1 and qn2 are the same
-int check_qn(Question *qn1, Question *qn2) {
+// Checks if a hot item is close enough to expiring to be fetched again
+int check_refresh(Cache_Item *item, time_t current) {
+    int expected = 0;
 
-    if (!check_qnform(qn1, qn2) || !check_qname(qn1, qn2)) {
+    if (atomic_fetch_add_explicit(&item->hits, 1, memory_order_relaxed) + 1 <
+        REFRESH_HITS ||
+        (item->expiry - current)*REFRESH_SHARE >
+        item->expiry - item->stored) {
         return 0;
     }
 
-    return 1;
+    // Only the first reader to get here asks for it
+    return atomic_compare_exchange_strong(&item->refreshing, &expected, 1);
 }
 
-// Checks if the form of the questions (num./size qname, qtype, qclass) match
-int check_qnform(Question *qn1, Question *qn2) {
-    if (qn1->name_count != qn2->name_count ||
-        qn1->name_size != qn2->name_size ||
-        memcmp(&qn1->qtype, &qn2->qtype, sizeof(u_int16_t)) ||
-        memcmp(&qn1->qclass, &qn2->qclass, sizeof(u_int16_t))) {
+// Lets the item answering the key be refreshed again, after its refresh
+// failed or was never sent
+void cancel_refresh(Cache *cache, unsigned char *key, int key_len) {
+    u_int32_t hash = hash_key(key, key_len);
+    Cache_Item *item = NULL;
 
-        return 0;
+    enter_epoch();
+    item = find_item(get_shard(cache, hash), key, key_len, hash);
+    if (item) {
+        atomic_store(&item->refreshing, 0);
+    }
+    exit_epoch();
+}
+
+// Checks if the message can be cached, either as an answer or as a
+// negative answer with the SOA its ttl is taken from (RFC 2308)
+int check_cacheable(Message *msg) {
+    int rcode = get_flags(msg) & 0x0f, soa = find_soa(msg);
+
+    if (msg->ans_count > 0) {
+        return rcode == NOERROR;
+    }
+
+    return (rcode == NOERROR || rcode == NXDOMAIN) && soa >= 0 &&
+        msg->rr_list[soa].rdata_len >= SOA_MIN_RDATA;
+}
+
+// Gets the index of the SOA record in the authority section, or -1
+int find_soa(Message *msg) {
+    int i;
+
+    for (i = msg->ans_count; i < msg->ans_count + msg->athr_count &&
+        i < msg->rr_count; i++) {
+        if (msg->rr_list[i].type == SOA) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Gets the lowest ttl of the answers in the message, or for a negative
+// answer the lower of its SOA's ttl and minimum field
+u_int32_t get_min_ttl(Message *msg) {
+    Record *soa = NULL;
+    u_int32_t ttl, minimum;
+    int i, pos;
+
+    // Minimum is the last field of the SOA's rdata
+    if (msg->ans_count == 0) {
+        soa = &msg->rr_list[find_soa(msg)];
+        pos = soa->rdata_off + soa->rdata_len - 4;
+        minimum = get_four_bytes(msg->buffer, &pos);
+        return soa->ttl < minimum ? soa->ttl : minimum;
+    }
+
+    ttl = msg->rr_list[0].ttl;
+
+    for (i = 1; i < msg->ans_count && i < msg->rr_count; i++) {
+        if (msg->rr_list[i].ttl < ttl) {
+            ttl = msg->rr_list[i].ttl;
+        }
     }
 
-    return 1;
+    return ttl;
 }
 
-// Checks if the names of the questions match
-int check_qname(Question *qn1, Question *qn2) {
+// Writes the ttl of every record of the cached answer into its copy in
+// buffer, counted down by the seconds the answer was cached
+void age_answer(Message *msg, unsigned char *buffer, time_t elapsed) {
+    Record *rr = NULL;
     int i;
 
-    for (i = 0; i < qn1->name_count; i++) {
-        if (memcmp(qn1->name[i]->label, qn2->name[i]->label,
-            qn1->name[i]->label_len)) {
-            return 0;
+    for (i = 0; i < msg->rr_count; i++) {
+        rr = &msg->rr_list[i];
+
+        // The ttl field of OPT holds flags instead
+        if (rr->type == OPT) {
+            continue;
         }
+        put_four_bytes(buffer, rr->ttl_off,
+            rr->ttl > elapsed ? rr->ttl - elapsed : 0);
     }
+}
 
-    return 1;
+// Gets the current time to the second without a system call
+time_t get_coarse_time() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+// Writes the lowercased qname, qtype and qclass of the question into key
+// and returns its length
+int make_key(Message *msg, unsigned char *key) {
+    Name *name = &msg->qn.name;
+
+    // Length bytes are below 64, so lowercasing leaves them as they are
+    lower_bytes(key, msg->buffer + name->off, name->len);
+
+    put_two_bytes(key, name->len, msg->qn.qtype);
+    put_two_bytes(key, name->len + 2, msg->qn.qclass);
+
+    return name->len + 4;
+}
+
+// Writes the key of the question at pos in a raw message, leaving pos after
+// it. Returns its length, or -1 if the name is not a plain one
+int make_raw_key(unsigned char *buffer, int size, int *pos,
+    unsigned char *key) {
+    int start = *pos, len, name_len;
+
+    // Checks the labels before lowercasing the whole name at once
+    do {
+        if (*pos >= size) {
+            return -1;
+        }
+
+        len = buffer[*pos];
+        if (len & POINTER_MASK || *pos + 1 + len > size ||
+            *pos + 1 + len - start > MAX_NAME_LEN) {
+            return -1;
+        }
+        *pos += 1 + len;
+    } while (len);
+
+    // Followed by the type and class, kept in network byte order
+    if (*pos + 4 > size) {
+        return -1;
+    }
+    name_len = *pos - start;
+    lower_bytes(key, buffer + start, name_len);
+    memcpy(key + name_len, buffer + *pos, 4);
+    *pos += 4;
+
+    return name_len + 4;
+}
+
+// Hashes the key with SipHash, keyed by a secret drawn at startup
+u_int32_t hash_key(unsigned char *key, int key_len) {
+    return hash_bytes(key, key_len);
 }
 
 // Frees memory allocated for the cache
 void free_cache(Cache *cache) {
-    Cache_Item *item = cache->item, *next_item = NULL;
-    
-    while (item) {
-        next_item = item->next_item;
-        free_item(item);
-        item = next_item;
+    Cache_Item *item = NULL, *next_item = NULL;
+    unsigned int i;
+
+    for (i = 0; i < cache->shard_count; i++) {
+        item = cache->shards[i].lru_head;
+        while (item) {
+            next_item = item->next_used;
+            free_item(item);
+            item = next_item;
+        }
+
+        pthread_mutex_destroy(&cache->shards[i].lock);
+        free(cache->shards[i].buckets);
+        free(cache->shards[i].swept);
     }
 
+    free(cache->shards);
     free(cache);
 }
 
@@ -164,3 +555,8 @@ void free_item(Cache_Item *item) {
     free_msg(item->msg);
     free(item);
 }
+
+// Frees a cache item retired by a writer
+void free_retired(void *item) {
+    free_item((Cache_Item*)item);
+}
@@ -2,52 +2,178 @@
 #define CACHE
 
 #include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "log.h"
+#include "fold.h"
 #include "message.h"
+#include "epoch.h"
+#include "timer.h"
 
-// Struct for each item in the cache
+#define KEY_SIZE (MAX_NAME_LEN + 4) // Lowercased qname, qtype and qclass
+
+// Called with a hot cached answer that is about to expire
+typedef void (*Refresh_Handler)(void *arg, Message *msg);
+
+// Struct for each item in the cache, never changed once it can be read. The
+// answer is kept as its wire bytes, indexed by the offsets of its ttls
 typedef struct item Cache_Item;
 
 struct item {
     Message *msg;
+    time_t stored;
     time_t expiry;
 
-    Cache_Item *next_item;
+    // Question the item answers
+    unsigned char key[KEY_SIZE];
+    int key_len;
+    u_int32_t hash;
+
+    // Set by readers, gives the item a second chance before eviction
+    atomic_int referenced;
+
+    // Hits so far, and whether a fresh answer has been asked for
+    atomic_uint hits;
+    atomic_int refreshing;
+
+    // Next item in the same bucket
+    Cache_Item *_Atomic next_item;
+
+    // Neighbours in the LRU list, most recently used first
+    Cache_Item *prev_used;
+    Cache_Item *next_used;
+
+    // Fires the second after the item can no longer be served stale
+    Timer timer;
 };
 
-// Struct for cache - a linked list
+// Part of the cache holding the keys whose hash selects it. Readers walk
+// the buckets without locking, writers hold the lock
 typedef struct {
-    Cache_Item *item;
+    pthread_mutex_t lock;
+
+    Cache_Item *_Atomic *buckets;
+    unsigned int bucket_count;
+    unsigned int capacity;
     unsigned int item_count;
+
+    Cache_Item *lru_head;
+    Cache_Item *lru_tail;
+
+    Timer_Wheel wheel;
+    time_t grace;
+
+    // Hash of the key last swept from each bucket, so an answer to the same
+    // question is still logged as replacing it
+    u_int32_t *swept;
+} Cache_Shard;
+
+// Struct for cache - hash tables of items chained by bucket, split into
+// shards so writers to different keys rarely contend
+typedef struct {
+    Cache_Shard *shards;
+    unsigned int shard_count;
+
+    // Second the expired items were last removed
+    _Atomic time_t swept;
+
+    // Seconds expired answers are kept to be served if the upstream fails
+    time_t grace;
+
+    // Answers replaced to make room, for the stats
+    atomic_ulong evictions;
+
+    // Asked to fetch hot answers again before they expire, if set
+    Refresh_Handler refresh;
+    void *refresh_arg;
 } Cache;
 
-// Creates an empty cache
-Cache *create_cache();
+// Creates an empty cache holding up to capacity items, which are kept for
+// grace seconds after they expire
+Cache *create_cache(unsigned int capacity, time_t grace);
 
 // Creates an item containing for the cache
 Cache_Item *create_item(Message *msg);
 
-// Adds a message into the cache
+// Adds a copy of a message into the cache
 void cache_item(Cache *cache, Message *msg);
 
-// Pops the first item from the cache
-void pop_cache(Cache *cache);
+// Searches the cache for a message and copies the answer into a new buffer
+// after headroom bytes, with the query's ID and aged ttls
+unsigned char *lookup(Cache *cache, Message *msg, int headroom, int *len);
+
+// Searches the cache for the question with the given key and copies the
+// answer into a new buffer after headroom bytes, with the given ID, the name
+// as it was asked and aged ttls
+unsigned char *lookup_key(Cache *cache, unsigned char *key, int key_len,
+    u_int32_t hash, u_int16_t id, unsigned char *name, int headroom,
+    int *len);
+
+// Searches the cache for a message, including answers that expired within
+// the grace window, and returns a copy of the answer
+Message *lookup_stale(Cache *cache, Message *msg);
+
+// Removes the items that expired since the last sweep, at most once a
+// second
+void expire_cache(Cache *cache);
+
+// Gets the shard holding the keys with the given hash
+Cache_Shard *get_shard(Cache *cache, u_int32_t hash);
+
+// Finds the item answering the question with the given key
+Cache_Item *find_item(Cache_Shard *shard, unsigned char *key, int key_len,
+    u_int32_t hash);
+
+// Removes the item from its bucket and from the LRU list
+void unlink_item(Cache_Shard *shard, Cache_Item *item);
+
+// Adds the item to its bucket and to the front of the LRU list
+void link_item(Cache_Shard *shard, Cache_Item *item);
 
-// Searches the cache for a message
-Message *lookup(Cache *cache, Message *msg);
+// Chooses the item to evict, moving recently read items to the front of
+// the LRU list instead
+Cache_Item *choose_victim(Cache_Shard *shard);
 
 // Checks if item is expired
-int check_expired(Cache_Item *item);
+int check_expired(Cache_Item *item, time_t current);
 
-// Checks if qn1 and qn2 are the same
-int check_qn(Question *qn1, Question *qn2);
+// Checks if a hot item is close enough to expiring to be fetched again
+int check_refresh(Cache_Item *item, time_t current);
 
-// Checks if the form of the questions (num./size qname, qtype, qclass) match
-int check_qnform(Question *qn1, Question *qn2);
+// Lets the item answering the key be refreshed again, after its refresh
+// failed or was never sent
+void cancel_refresh(Cache *cache, unsigned char *key, int key_len);
 
-// Checks if the names of the questions match
-int check_qname(Question *qn1, Question *qn2);
+// Checks if the message can be cached, either as an answer or as a
+// negative answer with the SOA its ttl is taken from (RFC 2308)
+int check_cacheable(Message *msg);
+
+// Gets the index of the SOA record in the authority section, or -1
+int find_soa(Message *msg);
+
+// Gets the lowest ttl of the answers in the message, or for a negative
+// answer the lower of its SOA's ttl and minimum field
+u_int32_t get_min_ttl(Message *msg);
+
+// Writes the ttl of every record of the cached answer into its copy in
+// buffer, counted down by the seconds the answer was cached
+void age_answer(Message *msg, unsigned char *buffer, time_t elapsed);
+
+// Gets the current time to the second without a system call
+time_t get_coarse_time();
+
+// Writes the lowercased qname, qtype and qclass of the question into key
+// and returns its length
+int make_key(Message *msg, unsigned char *key);
+
+// Writes the key of the question at pos in a raw message, leaving pos after
+// it. Returns its length, or -1 if the name is not a plain one
+int make_raw_key(unsigned char *buffer, int size, int *pos,
+    unsigned char *key);
+
+// Hashes the key with SipHash, keyed by a secret drawn at startup
+u_int32_t hash_key(unsigned char *key, int key_len);
 
 // Frees memory allocated for the cache
 void free_cache(Cache *cache);
@@ -55,4 +181,7 @@ void free_cache(Cache *cache);
 // Frees memory allocated for the cache item
 void free_item(Cache_Item *item);
 
+// Frees a cache item retired by a writer
+void free_retired(void *item);
+
 #endif
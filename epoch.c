@@ -0,0 +1,97 @@
+#include "epoch.h"
+
+#define QUIESCENT 0     // Epoch announced by threads not reading
+#define GRACE_EPOCHS 2  // Epochs after retiring before nothing holds an object
+
+// Epoch every reader must have seen before it can advance, starts above
+// QUIESCENT
+static _Atomic unsigned long global_epoch = 1;
+
+static Epoch_Slot slots[MAX_EPOCH_THREADS];
+static _Atomic int slot_count = 0;
+
+// Each thread reclaims the objects it retired itself
+static __thread Epoch_Slot *thread_slot = NULL;
+static __thread Retired *retired_list = NULL;
+static __thread int retired_count = 0;
+
+// Marks the calling thread as reading shared data
+void enter_epoch() {
+    Epoch_Slot *slot = get_epoch_slot();
+
+    // Sequentially consistent so the epoch is announced before any shared
+    // pointer is loaded
+    atomic_store(&slot->epoch, atomic_load(&global_epoch));
+}
+
+// Marks the calling thread as no longer reading shared data
+void exit_epoch() {
+    atomic_store_explicit(&get_epoch_slot()->epoch, QUIESCENT,
+        memory_order_release);
+}
+
+// Frees the object once every reader that could have seen it has finished
+void retire_ptr(void *ptr, Free_Function free_fn) {
+    Retired *retired = malloc(sizeof(*retired));
+    assert(retired);
+
+    retired->ptr = ptr;
+    retired->free_fn = free_fn;
+    retired->epoch = atomic_load(&global_epoch);
+    retired->next = retired_list;
+    retired_list = retired;
+
+    if (++retired_count >= RECLAIM_BATCH) {
+        advance_epoch();
+        reclaim_retired();
+    }
+}
+
+// Advances the global epoch if every reader has seen the current one
+void advance_epoch() {
+    unsigned long epoch = atomic_load(&global_epoch), seen;
+    int i, count = atomic_load(&slot_count);
+
+    for (i = 0; i < count; i++) {
+        seen = atomic_load(&slots[i].epoch);
+        if (seen != QUIESCENT && seen != epoch) {
+            return;
+        }
+    }
+
+    // Fails harmlessly if another thread advanced it first
+    atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1);
+}
+
+// Frees the calling thread's retired objects that are no longer reachable
+void reclaim_retired() {
+    unsigned long epoch = atomic_load(&global_epoch);
+    Retired **link = &retired_list, *retired = NULL;
+
+    while ((retired = *link)) {
+        if (retired->epoch + GRACE_EPOCHS <= epoch) {
+            *link = retired->next;
+            retired->free_fn(retired->ptr);
+            free(retired);
+            retired_count--;
+        } else {
+            link = &retired->next;
+        }
+    }
+}
+
+// Gets the slot of the calling thread, taking one on its first use
+Epoch_Slot *get_epoch_slot() {
+    int i;
+
+    if (!thread_slot) {
+        i = atomic_fetch_add(&slot_count, 1);
+        if (i >= MAX_EPOCH_THREADS) {
+            fprintf(stderr, "too many threads reading the cache\n");
+            exit(EXIT_FAILURE);
+        }
+        thread_slot = &slots[i];
+    }
+
+    return thread_slot;
+}
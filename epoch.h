@@ -0,0 +1,50 @@
+#ifndef EPOCH
+#define EPOCH
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdatomic.h>
+
+#define MAX_EPOCH_THREADS 64    // Most threads that may read shared data
+#define RECLAIM_BATCH 32        // Retired objects gathered before reclaiming
+
+// Frees an object no reader can reach any more
+typedef void (*Free_Function)(void *ptr);
+
+// Object unlinked by a writer, waiting until no reader can still hold it
+typedef struct retired Retired;
+
+struct retired {
+    void *ptr;
+    Free_Function free_fn;
+    unsigned long epoch;
+
+    Retired *next;
+};
+
+// Epoch a thread announced when it began reading, padded to its own line
+typedef struct {
+    _Atomic unsigned long epoch;
+    char pad[64 - sizeof(unsigned long)];
+} Epoch_Slot;
+
+// Marks the calling thread as reading shared data
+void enter_epoch();
+
+// Marks the calling thread as no longer reading shared data
+void exit_epoch();
+
+// Frees the object once every reader that could have seen it has finished
+void retire_ptr(void *ptr, Free_Function free_fn);
+
+// Advances the global epoch if every reader has seen the current one
+void advance_epoch();
+
+// Frees the calling thread's retired objects that are no longer reachable
+void reclaim_retired();
+
+// Gets the slot of the calling thread, taking one on its first use
+Epoch_Slot *get_epoch_slot();
+
+#endif
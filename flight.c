@@ -0,0 +1,108 @@
+#include "flight.h"
+
+// Creates an empty in-flight table
+Flight_Table *create_flights() {
+    Flight_Table *table = malloc(sizeof(*table));
+    int i;
+
+    assert(table);
+    memset(table->buckets, 0, sizeof(table->buckets));
+    for (i = 0; i < FLIGHT_LOCKS; i++) {
+        pthread_mutex_init(&table->locks[i], NULL);
+    }
+
+    return table;
+}
+
+// Joins the flight for the message's question, returns 1 if there was none
+// and the caller should send the query upstream, or 0 if it was parked
+int join_flight(Flight_Table *table, Message *msg, void *owner, void *loop) {
+    Flight *flight = NULL;
+    Waiter *waiter = NULL;
+    unsigned char key[KEY_SIZE];
+    int key_len = make_key(msg, key), bucket;
+    u_int32_t hash = hash_key(key, key_len);
+
+    bucket = hash & (FLIGHT_BUCKETS - 1);
+    pthread_mutex_lock(&table->locks[bucket % FLIGHT_LOCKS]);
+
+    for (flight = table->buckets[bucket]; flight; flight = flight->next) {
+        if (flight->hash == hash && flight->key_len == key_len &&
+            !memcmp(flight->key, key, key_len)) {
+            break;
+        }
+    }
+
+    if (flight) {
+        // Waits for the query already upstream
+        waiter = malloc(sizeof(*waiter));
+        assert(waiter);
+        waiter->owner = owner;
+        waiter->loop = loop;
+        waiter->next = flight->waiters;
+        flight->waiters = waiter;
+    } else {
+        flight = malloc(sizeof(*flight));
+        assert(flight);
+        memcpy(flight->key, key, key_len);
+        flight->key_len = key_len;
+        flight->hash = hash;
+        flight->waiters = NULL;
+        flight->next = table->buckets[bucket];
+        table->buckets[bucket] = flight;
+    }
+
+    pthread_mutex_unlock(&table->locks[bucket % FLIGHT_LOCKS]);
+
+    return waiter == NULL;
+}
+
+// Ends the flight for the message's question and returns its waiters
+Waiter *land_flight(Flight_Table *table, Message *msg) {
+    Flight **link = NULL, *flight = NULL;
+    Waiter *waiters = NULL;
+    unsigned char key[KEY_SIZE];
+    int key_len = make_key(msg, key), bucket;
+    u_int32_t hash = hash_key(key, key_len);
+
+    bucket = hash & (FLIGHT_BUCKETS - 1);
+    pthread_mutex_lock(&table->locks[bucket % FLIGHT_LOCKS]);
+
+    for (link = &table->buckets[bucket]; (flight = *link);
+        link = &flight->next) {
+        if (flight->hash == hash && flight->key_len == key_len &&
+            !memcmp(flight->key, key, key_len)) {
+            *link = flight->next;
+            waiters = flight->waiters;
+            free(flight);
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&table->locks[bucket % FLIGHT_LOCKS]);
+
+    return waiters;
+}
+
+// Frees memory allocated for the in-flight table
+void free_flights(Flight_Table *table) {
+    Flight *flight = NULL;
+    Waiter *waiter = NULL;
+    int i;
+
+    for (i = 0; i < FLIGHT_BUCKETS; i++) {
+        while ((flight = table->buckets[i])) {
+            table->buckets[i] = flight->next;
+            while ((waiter = flight->waiters)) {
+                flight->waiters = waiter->next;
+                free(waiter);
+            }
+            free(flight);
+        }
+    }
+
+    for (i = 0; i < FLIGHT_LOCKS; i++) {
+        pthread_mutex_destroy(&table->locks[i]);
+    }
+    free(table);
+}
@@ -0,0 +1,53 @@
+#ifndef FLIGHT
+#define FLIGHT
+
+#include <pthread.h>
+
+#include "message.h"
+#include "cache.h"
+
+#define FLIGHT_BUCKETS 4096 // Buckets of the in-flight table, power of two
+#define FLIGHT_LOCKS 64     // Locks shared out over the buckets
+
+// Query parked until the one sent upstream for the same question returns
+typedef struct waiter Waiter;
+
+struct waiter {
+    void *owner;
+    void *loop;     // Event loop the owner belongs to
+
+    Waiter *next;
+};
+
+// Question that has been sent upstream and not answered yet
+typedef struct flight Flight;
+
+struct flight {
+    unsigned char key[KEY_SIZE];
+    int key_len;
+    u_int32_t hash;
+
+    Waiter *waiters;
+    Flight *next;
+};
+
+// Questions in flight, shared by all event loops
+typedef struct {
+    pthread_mutex_t locks[FLIGHT_LOCKS];
+    Flight *buckets[FLIGHT_BUCKETS];
+} Flight_Table;
+
+// Creates an empty in-flight table
+Flight_Table *create_flights();
+
+// Joins the flight for the message's question, returns 1 if there was none
+// and the caller should send the query upstream, or 0 if it was parked
+int join_flight(Flight_Table *table, Message *msg, void *owner, void *loop);
+
+// Ends the flight for the message's question and returns its waiters
+Waiter *land_flight(Flight_Table *table, Message *msg);
+
+// Frees memory allocated for the in-flight table
+void free_flights(Flight_Table *table);
+
+#endif
@@ -0,0 +1,170 @@
+#include "fold.h"
+
+#define CASE_BIT 0x20           // Set in lowercase ASCII letters
+#define SIP_C_ROUNDS 1          // Rounds per 8 bytes of input
+#define SIP_D_ROUNDS 3          // Rounds finishing the hash
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+// Version picked for this CPU and key drawn before main runs
+static void (*lower_impl)(unsigned char*, unsigned char*, int) = lower_scalar;
+static u_int64_t hash_key_words[2];
+
+// Lowercases len bytes of src into dst, which may be the same buffer
+void lower_bytes(unsigned char *dst, unsigned char *src, int len) {
+    lower_impl(dst, src, len);
+}
+
+// Hashes len bytes with SipHash-1-3 under a key drawn when the process
+// starts, so clients cannot pick names that collide. Only stable within one
+// process
+u_int32_t hash_bytes(unsigned char *src, int len) {
+    u_int64_t v[4] = {
+        hash_key_words[0] ^ 0x736f6d6570736575ULL,
+        hash_key_words[1] ^ 0x646f72616e646f6dULL,
+        hash_key_words[0] ^ 0x6c7967656e657261ULL,
+        hash_key_words[1] ^ 0x7465646279746573ULL};
+    u_int64_t word;
+    int i, j;
+
+    // Words are taken in host order, which is SipHash's own on little-endian
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy(&word, src + i, sizeof(word));
+        v[3] ^= word;
+        for (j = 0; j < SIP_C_ROUNDS; j++) {
+            sip_round(v);
+        }
+        v[0] ^= word;
+    }
+
+    // The last word holds what is left, with the length in its top byte
+    word = (u_int64_t)len << 56;
+    for (j = 0; i + j < len; j++) {
+        word |= (u_int64_t)src[i + j] << (8*j);
+    }
+    v[3] ^= word;
+    for (j = 0; j < SIP_C_ROUNDS; j++) {
+        sip_round(v);
+    }
+    v[0] ^= word;
+
+    v[2] ^= 0xff;
+    for (j = 0; j < SIP_D_ROUNDS; j++) {
+        sip_round(v);
+    }
+    word = v[0] ^ v[1] ^ v[2] ^ v[3];
+
+    return (u_int32_t)(word ^ (word >> 32));
+}
+
+// Replaces the hash key, for runs that must spread keys the same way each
+// time. Only safe before any key is hashed
+void set_hash_key(u_int64_t k0, u_int64_t k1) {
+    hash_key_words[0] = k0;
+    hash_key_words[1] = k1;
+}
+
+// Mixes the SipHash state once
+void sip_round(u_int64_t v[4]) {
+    v[0] += v[1];
+    v[1] = ROTL(v[1], 13) ^ v[0];
+    v[0] = ROTL(v[0], 32);
+    v[2] += v[3];
+    v[3] = ROTL(v[3], 16) ^ v[2];
+    v[0] += v[3];
+    v[3] = ROTL(v[3], 21) ^ v[0];
+    v[2] += v[1];
+    v[1] = ROTL(v[1], 17) ^ v[2];
+    v[2] = ROTL(v[2], 32);
+}
+
+// Lowercases a byte at a time, only touching A to Z whatever the locale
+void lower_scalar(unsigned char *dst, unsigned char *src, int len) {
+    int i;
+
+    for (i = 0; i < len; i++) {
+        dst[i] = src[i] | ((unsigned char)(src[i] - 'A') < 26)*CASE_BIT;
+    }
+}
+
+#ifdef FOLD_X86
+
+// Lowercases 16 bytes. Bytes above 0x7f compare as negative, so only A to Z
+// fall in the range
+__m128i lower_16(__m128i bytes) {
+    __m128i upper = _mm_and_si128(
+        _mm_cmpgt_epi8(bytes, _mm_set1_epi8('A' - 1)),
+        _mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), bytes));
+
+    return _mm_or_si128(bytes,
+        _mm_and_si128(upper, _mm_set1_epi8(CASE_BIT)));
+}
+
+// Lowercases 16 bytes at a time, SSE2 being there on every x86-64
+void lower_sse2(unsigned char *dst, unsigned char *src, int len) {
+    int i;
+
+    if (len < 16) {
+        lower_scalar(dst, src, len);
+        return;
+    }
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        _mm_storeu_si128((__m128i*)(dst + i),
+            lower_16(_mm_loadu_si128((__m128i*)(src + i))));
+    }
+
+    // The tail overlaps the last block, lowercasing some bytes twice
+    if (i < len) {
+        i = len - 16;
+        _mm_storeu_si128((__m128i*)(dst + i),
+            lower_16(_mm_loadu_si128((__m128i*)(src + i))));
+    }
+}
+
+// Lowercases 32 bytes at a time, then hands the rest to SSE2
+__attribute__((target("avx2")))
+void lower_avx2(unsigned char *dst, unsigned char *src, int len) {
+    __m256i bytes, upper;
+    int i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        bytes = _mm256_loadu_si256((__m256i*)(src + i));
+        upper = _mm256_and_si256(
+            _mm256_cmpgt_epi8(bytes, _mm256_set1_epi8('A' - 1)),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), bytes));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_or_si256(bytes,
+            _mm256_and_si256(upper, _mm256_set1_epi8(CASE_BIT))));
+    }
+
+    // A short tail is lowercased with the bytes before it, some twice
+    if (len - i < 16 && len >= 16) {
+        i = len - 16;
+    }
+    lower_sse2(dst + i, src + i, len - i);
+}
+
+#endif
+
+// Draws the hash key and picks the widest versions the CPU runs, before any
+// thread can call them
+__attribute__((constructor))
+void pick_impl() {
+    struct timespec now;
+    int fd = open("/dev/urandom", O_RDONLY);
+
+    // Falls back to the clock, pid and stack, weaker but not fixed
+    if (fd < 0 || read(fd, hash_key_words, sizeof(hash_key_words)) !=
+        sizeof(hash_key_words)) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        hash_key_words[0] = (u_int64_t)now.tv_nsec << 32 ^ now.tv_sec;
+        hash_key_words[1] = (u_int64_t)getpid() << 32 ^ (unsigned long)&now;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+#ifdef FOLD_X86
+    __builtin_cpu_init();
+    lower_impl = __builtin_cpu_supports("avx2") ? lower_avx2 : lower_sse2;
+#endif
+}
@@ -0,0 +1,52 @@
+#ifndef FOLD
+#define FOLD
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#define FOLD_X86
+#endif
+
+// Lowercases len bytes of src into dst, which may be the same buffer
+void lower_bytes(unsigned char *dst, unsigned char *src, int len);
+
+// Hashes len bytes with SipHash-1-3 under a key drawn when the process
+// starts, so clients cannot pick names that collide. Only stable within one
+// process
+u_int32_t hash_bytes(unsigned char *src, int len);
+
+// Replaces the hash key, for runs that must spread keys the same way each
+// time. Only safe before any key is hashed
+void set_hash_key(u_int64_t k0, u_int64_t k1);
+
+// Mixes the SipHash state once
+void sip_round(u_int64_t v[4]);
+
+// Lowercases a byte at a time, only touching A to Z whatever the locale
+void lower_scalar(unsigned char *dst, unsigned char *src, int len);
+
+// Draws the hash key and picks the widest versions the CPU runs, before any
+// thread can call them
+void pick_impl();
+
+#ifdef FOLD_X86
+
+// Lowercases 16 bytes. Bytes above 0x7f compare as negative, so only A to Z
+// fall in the range
+__m128i lower_16(__m128i bytes);
+
+// Lowercases 16 bytes at a time, SSE2 being there on every x86-64
+void lower_sse2(unsigned char *dst, unsigned char *src, int len);
+
+// Lowercases 32 bytes at a time, then hands the rest to SSE2
+void lower_avx2(unsigned char *dst, unsigned char *src, int len);
+
+#endif
+
+#endif
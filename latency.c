@@ -0,0 +1,101 @@
+#include "latency.h"
+
+#define MIN_SAMPLES 8           // Round trips needed to trust the percentile
+#define PERCENTILE_EVERY 16     // Round trips between percentile updates
+#define DEFAULT_HEDGE 200000    // Hedge delay in us before enough samples
+#define MIN_HEDGE 10000         // Shortest hedge delay in us
+#define DOWN_TIME 5000000       // Time in us a failing upstream is skipped
+
+// Sets up the latency of an upstream that has not answered yet
+void init_latency(Latency *lat) {
+    memset(lat, 0, sizeof(*lat));
+}
+
+// Adds the round trip time of an answer
+void record_rtt(Latency *lat, long rtt) {
+    long diff;
+
+    // First sample sets the estimate, the rest move it by 1/8 and the
+    // deviation by 1/4
+    if (lat->sample_count == 0) {
+        lat->srtt = rtt;
+        lat->rttvar = rtt / 2;
+    } else {
+        diff = lat->srtt > rtt ? lat->srtt - rtt : rtt - lat->srtt;
+        lat->rttvar += (diff - lat->rttvar) / 4;
+        lat->srtt += (rtt - lat->srtt) / 8;
+    }
+
+    lat->samples[lat->sample_count++ % RTT_SAMPLES] = rtt;
+    lat->failures = 0;
+    lat->down_until = 0;
+
+    if (lat->sample_count == MIN_SAMPLES ||
+        lat->sample_count % PERCENTILE_EVERY == 0) {
+        update_percentile(lat);
+    }
+}
+
+// Adds a wait cut short before the answer came, so only known to be at
+// least rtt. Says nothing about whether the upstream is up
+void record_censored(Latency *lat, long rtt) {
+    int failures = lat->failures;
+    long down_until = lat->down_until;
+
+    // A wait shorter than the estimate tells nothing new about it
+    if (lat->sample_count > 0 && rtt <= lat->srtt) {
+        return;
+    }
+
+    record_rtt(lat, rtt);
+    lat->failures = failures;
+    lat->down_until = down_until;
+}
+
+// Counts a failed query, marking the upstream down after too many
+void record_failure(Latency *lat, long now) {
+    if (++lat->failures >= FAILURE_LIMIT) {
+        lat->down_until = now + DOWN_TIME;
+    }
+}
+
+// Checks if the upstream is worth sending queries to
+int check_healthy(Latency *lat, long now) {
+    return lat->failures < FAILURE_LIMIT || now >= lat->down_until;
+}
+
+// Gets how long to wait for an answer before hedging the query
+long get_hedge_delay(Latency *lat) {
+    if (lat->sample_count < MIN_SAMPLES) {
+        return DEFAULT_HEDGE;
+    }
+
+    return lat->percentile > MIN_HEDGE ? lat->percentile : MIN_HEDGE;
+}
+
+// Takes the percentile of the recent round trip times
+void update_percentile(Latency *lat) {
+    long sorted[RTT_SAMPLES];
+    int count = lat->sample_count < RTT_SAMPLES ? lat->sample_count :
+        RTT_SAMPLES;
+
+    memcpy(sorted, lat->samples, count*sizeof(long));
+    qsort(sorted, count, sizeof(long), compare_rtt);
+    lat->percentile = sorted[(count - 1)*HEDGE_PERCENTILE / 100];
+}
+
+// Orders two round trip times for qsort
+int compare_rtt(const void *a, const void *b) {
+    long x = *(const long*)a, y = *(const long*)b;
+
+    return (x > y) - (x < y);
+}
+
+// Gets the current time in microseconds, for measuring round trips
+long get_micros() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec*1000000L + now.tv_nsec / 1000;
+}
@@ -0,0 +1,56 @@
+#ifndef LATENCY
+#define LATENCY
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define RTT_SAMPLES 64      // Recent round trips the percentile is taken of
+#define HEDGE_PERCENTILE 95 // Share of answers expected before a hedge
+#define FAILURE_LIMIT 3     // Failures in a row marking an upstream down
+
+// Round trip times of the answers from one upstream, in microseconds
+typedef struct {
+    // Smoothed round trip time and its mean deviation (RFC 6298)
+    long srtt;
+    long rttvar;
+
+    // Most recent round trips, and the percentile taken of them
+    long samples[RTT_SAMPLES];
+    unsigned long sample_count;
+    long percentile;
+
+    // Failures since the last answer, and when it may be tried again
+    int failures;
+    long down_until;
+} Latency;
+
+// Sets up the latency of an upstream that has not answered yet
+void init_latency(Latency *lat);
+
+// Adds the round trip time of an answer
+void record_rtt(Latency *lat, long rtt);
+
+// Adds a wait cut short before the answer came, so only known to be at
+// least rtt. Says nothing about whether the upstream is up
+void record_censored(Latency *lat, long rtt);
+
+// Counts a failed query, marking the upstream down after too many
+void record_failure(Latency *lat, long now);
+
+// Checks if the upstream is worth sending queries to
+int check_healthy(Latency *lat, long now);
+
+// Gets how long to wait for an answer before hedging the query
+long get_hedge_delay(Latency *lat);
+
+// Takes the percentile of the recent round trip times
+void update_percentile(Latency *lat);
+
+// Orders two round trip times for qsort
+int compare_rtt(const void *a, const void *b);
+
+// Gets the current time in microseconds, for measuring round trips
+long get_micros();
+
+#endif
@@ -1,88 +1,232 @@
 #include "log.h"
 
+#define ON 1                    // Keeps writing the log
 #define LOG_NAME "dns_svr.log"  // Name of log
 #define TIMESTAMP_LEN 30        // Length of timestamp string
+#define LOG_BUFFER_SIZE (1 << 16)   // Lines gathered before each write
 
-#define CURRENT 0               // Flag to get current time
+static Log_Ring ring;
+
+// Opens the log and starts the thread that writes it
+void start_logger() {
+    pthread_t thread;
+    FILE *log = fopen(LOG_NAME, "a");
+    unsigned long i;
+
+    if (!log) {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < LOG_SLOTS; i++) {
+        atomic_init(&ring.slots[i].seq, i);
+    }
+    atomic_init(&ring.head, 0);
+    ring.tail = 0;
+    atomic_init(&ring.sleeping, 0);
+
+    if ((ring.wakefd = eventfd(0, 0)) < 0) {
+        perror("eventfd");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_create(&thread, NULL, run_logger, log);
+    pthread_detach(thread);
+}
 
 // Logs the request line
 void log_request(Message *msg) {
-    FILE *log = fopen(LOG_NAME, "a+");
-    char *tm_str = get_time_str(CURRENT);
+    unsigned long pos;
+    Log_Record *record = claim_record(REQUEST, &pos);
 
-    fprintf(log, "%s requested %s\n", tm_str, get_domain(msg));
-    fflush(log);
-    fclose(log);
-    free(tm_str);
+    get_domain(msg, record->dmn);
+    publish_record(pos);
+}
+
+// Logs the request line of a question still in its wire form
+void log_question(unsigned char *name) {
+    unsigned long pos;
+    Log_Record *record = claim_record(REQUEST, &pos);
+
+    get_wire_domain(name, record->dmn);
+    publish_record(pos);
 }
 
 // Logs the result line
 void log_result(Message *msg) {
-    FILE *log = fopen(LOG_NAME, "a+");
-    struct sockaddr_in6 addr;
-    char res_ip[INET6_ADDRSTRLEN], *tm_str = get_time_str(CURRENT);
-
-    // Gets the IP of the first answer
-    memset(&addr, 0, sizeof(addr));
-    inet_ntop(AF_INET6, msg->ans_list[0]->rdata, res_ip, INET6_ADDRSTRLEN);
-
-    fprintf(log, "%s %s is at %s\n", tm_str, get_domain(msg), res_ip);
-    fflush(log);
-    fclose(log);
-    free(tm_str);
+    unsigned long pos;
+    Log_Record *record = claim_record(RESULT, &pos);
+
+    // Keeps the IP of the first answer, formatted by the writer
+    get_domain(msg, record->dmn);
+    memcpy(record->ip, get_rdata(msg, 0), IPv6_SIZE);
+    publish_record(pos);
 }
 
 // Logs an unimplemented request
 void log_unimplemented() {
-    FILE *log = fopen(LOG_NAME, "a+");
-    char *tm_str = get_time_str(CURRENT);
+    unsigned long pos;
 
-    fprintf(log, "%s unimplemented request\n", tm_str);
-    fflush(log);
-    fclose(log);
-    free(tm_str);
+    claim_record(UNIMPLEMENTED, &pos);
+    publish_record(pos);
 }
 
 // Logs if found has been found in cache
 void log_found(Message *msg, time_t expiry) {
-    FILE *log = fopen(LOG_NAME, "a+");
-    char *curr_tm_str = get_time_str(CURRENT);
-    char *exp_tm_str = get_time_str(expiry);
-
-    fprintf(log, "%s %s expires at %s\n",
-    curr_tm_str, get_domain(msg), exp_tm_str);
-    fflush(log);
-    fclose(log);
-    free(curr_tm_str);
-    free(exp_tm_str);
+    unsigned long pos;
+    Log_Record *record = claim_record(FOUND, &pos);
+
+    get_domain(msg, record->dmn);
+    record->expiry = expiry;
+    publish_record(pos);
 }
 
 // Logs cache eviction
 void log_replace(Message *prev, Message *next) {
-    FILE *log = fopen(LOG_NAME, "a+");
-    char *tm_str = get_time_str(CURRENT);
-
-    fprintf(log, "%s replacing %s by %s\n",
-    tm_str, get_domain(prev), get_domain(next));
-    fflush(log);
-    fclose(log);
-    free(tm_str);
+    unsigned long pos;
+    Log_Record *record = claim_record(REPLACE, &pos);
+
+    get_domain(prev, record->dmn);
+    get_domain(next, record->next_dmn);
+    publish_record(pos);
+}
+
+// Claims the next slot of the ring, waiting for the writer if it is full
+Log_Record *claim_record(Log_Type type, unsigned long *pos) {
+    Log_Slot *slot = NULL;
+    unsigned long seq;
+    long diff;
+
+    *pos = atomic_load_explicit(&ring.head, memory_order_relaxed);
+    while (ON) {
+        slot = &ring.slots[*pos & (LOG_SLOTS - 1)];
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        diff = (long)seq - (long)*pos;
+
+        if (diff == 0) {
+            // Free for this position, taken if no other thread got it first
+            if (atomic_compare_exchange_weak_explicit(&ring.head, pos,
+                *pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Full, lines are never dropped
+            sched_yield();
+            *pos = atomic_load_explicit(&ring.head, memory_order_relaxed);
+        } else {
+            *pos = atomic_load_explicit(&ring.head, memory_order_relaxed);
+        }
+    }
+
+    slot->record.type = type;
+    slot->record.time = time(NULL);
+
+    return &slot->record;
+}
+
+// Hands a filled slot to the writer
+void publish_record(unsigned long pos) {
+    u_int64_t one = 1;
+
+    atomic_store_explicit(&ring.slots[pos & (LOG_SLOTS - 1)].seq, pos + 1,
+        memory_order_release);
+
+    // Orders the store before the check, or the writer could go to sleep
+    // after missing this line while this check misses the sleep
+    atomic_thread_fence(memory_order_seq_cst);
+
+    // Only costs a system call when the writer has gone to sleep
+    if (atomic_load(&ring.sleeping) &&
+        atomic_exchange(&ring.sleeping, 0)) {
+        if (write(ring.wakefd, &one, sizeof(one)) < 0) {
+            perror("write");
+        }
+    }
 }
 
-// Gets the current time or expiry as string
-char *get_time_str(time_t expiry) {
-    time_t current;
-    struct tm *tm_t = malloc(sizeof(*tm_t));
-    char *str = malloc(TIMESTAMP_LEN);
-
-    if (expiry) {
-        tm_t = localtime_r(&expiry, tm_t);
-    } else {
-        time(&current);
-        tm_t = localtime_r(&current, tm_t);
+// Writes every queued line to the log, sleeping while there are none
+void *run_logger(void *param) {
+    FILE *log = (FILE*)param;
+    Log_Slot *slot = NULL;
+    u_int64_t count;
+
+    setvbuf(log, NULL, _IOFBF, LOG_BUFFER_SIZE);
+
+    while (ON) {
+        slot = &ring.slots[ring.tail & (LOG_SLOTS - 1)];
+
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) ==
+            ring.tail + 1) {
+            write_record(log, &slot->record);
+
+            // Frees the slot for the lap after this one
+            atomic_store_explicit(&slot->seq, ring.tail + LOG_SLOTS,
+                memory_order_release);
+            ring.tail++;
+            continue;
+        }
+
+        // Everything queued so far goes out in one write
+        fflush(log);
+
+        // Checks again after announcing the sleep, so a line published in
+        // between is not left waiting
+        atomic_store(&ring.sleeping, 1);
+        if (atomic_load(&slot->seq) == ring.tail + 1) {
+            atomic_store(&ring.sleeping, 0);
+            continue;
+        }
+        if (read(ring.wakefd, &count, sizeof(count)) < 0) {
+            perror("read");
+        }
+    }
+
+    return NULL;
+}
+
+// Writes one line to the log
+void write_record(FILE *log, Log_Record *record) {
+    static time_t tm_cached = -1, exp_cached = -1;
+    static char tm_str[TIMESTAMP_LEN], exp_str[TIMESTAMP_LEN];
+    char res_ip[INET6_ADDRSTRLEN];
+
+    get_time_str(record->time, &tm_cached, tm_str);
+
+    switch (record->type) {
+    case REQUEST:
+        fprintf(log, "%s requested %s\n", tm_str, record->dmn);
+        break;
+
+    case RESULT:
+        inet_ntop(AF_INET6, record->ip, res_ip, INET6_ADDRSTRLEN);
+        fprintf(log, "%s %s is at %s\n", tm_str, record->dmn, res_ip);
+        break;
+
+    case UNIMPLEMENTED:
+        fprintf(log, "%s unimplemented request\n", tm_str);
+        break;
+
+    case FOUND:
+        get_time_str(record->expiry, &exp_cached, exp_str);
+        fprintf(log, "%s %s expires at %s\n", tm_str, record->dmn, exp_str);
+        break;
+
+    case REPLACE:
+        fprintf(log, "%s replacing %s by %s\n", tm_str, record->dmn,
+            record->next_dmn);
+        break;
+    }
+}
+
+// Gets the time as a string, reusing the last one within the same second
+const char *get_time_str(time_t time, time_t *cached_time, char *str) {
+    struct tm tm_t;
+
+    if (time != *cached_time) {
+        localtime_r(&time, &tm_t);
+        strftime(str, TIMESTAMP_LEN, "%FT%T%z", &tm_t);
+        *cached_time = time;
     }
 
-    strftime(str, TIMESTAMP_LEN, "%FT%T%z", tm_t);
-    free(tm_t);
     return str;
 }
@@ -5,12 +5,63 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
 
 #include "message.h"
 
+#define LOG_SLOTS 4096      // Lines that can wait for the writer, power of two
+#define IPv6_SIZE 16        // Size of an AAAA record's rdata
+
+// Kinds of line written to the log
+typedef enum {
+    REQUEST,
+    RESULT,
+    UNIMPLEMENTED,
+    FOUND,
+    REPLACE
+} Log_Type;
+
+// Line waiting to be written, formatted by the writer
+typedef struct {
+    Log_Type type;
+    time_t time;
+    time_t expiry;
+
+    char dmn[DOMAIN_LEN];
+    char next_dmn[DOMAIN_LEN];
+    unsigned char ip[IPv6_SIZE];
+} Log_Record;
+
+// Slot of the ring, its sequence says whose turn it is to use it
+typedef struct {
+    _Atomic unsigned long seq;
+    Log_Record record;
+} Log_Slot;
+
+// Ring that request threads push lines into and one writer drains
+typedef struct {
+    Log_Slot slots[LOG_SLOTS];
+
+    _Atomic unsigned long head; // Next slot to fill
+    unsigned long tail;         // Next slot to write, only the writer's
+
+    // Woken through the eventfd only when it is asleep
+    int wakefd;
+    atomic_int sleeping;
+} Log_Ring;
+
+// Opens the log and starts the thread that writes it
+void start_logger();
+
 // Logs the request line
 void log_request(Message *msg);
 
+// Logs the request line of a question still in its wire form
+void log_question(unsigned char *name);
+
 // Logs the result line
 void log_result(Message *msg);
 
@@ -23,7 +74,19 @@ void log_found(Message *msg, time_t expiry);
 // Logs cache eviction
 void log_replace(Message *prev, Message *next);
 
-// Gets the current time or expiry as string
-char *get_time_str(time_t expiry);
+// Claims the next slot of the ring, waiting for the writer if it is full
+Log_Record *claim_record(Log_Type type, unsigned long *pos);
+
+// Hands a filled slot to the writer
+void publish_record(unsigned long pos);
+
+// Writes every queued line to the log, sleeping while there are none
+void *run_logger(void *param);
+
+// Writes one line to the log
+void write_record(FILE *log, Log_Record *record);
+
+// Gets the time as a string, reusing the last one within the same second
+const char *get_time_str(time_t time, time_t *cached_time, char *str);
 
 #endif
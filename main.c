@@ -1,10 +1,55 @@
 #include "server.h"
 
+#define CACHE_LIMIT 5   // Default maximum items allowed in cache
+#define STALE_GRACE 0   // Default seconds expired answers may be served
+
 // Runs the program
 int main(int argc, char* argv[]) {
+    int opt, capacity = CACHE_LIMIT, grace = STALE_GRACE, use_ring = 0;
+    int metrics_port = 0;
+    int i, upstream_count;
+    Address upstreams[MAX_UPSTREAMS];
+
+    // -c sets how many answers the cache holds, -s how many seconds expired
+    // answers are kept to be served while the upstream fails, -u drives
+    // client connections through io_uring, -m serves the stats on a local
+    // port
+    while ((opt = getopt(argc, argv, "c:s:um:")) != -1) {
+        switch (opt) {
+        case 'c':
+            capacity = atoi(optarg);
+            break;
+        case 's':
+            grace = atoi(optarg);
+            break;
+        case 'u':
+            use_ring = 1;
+            break;
+        case 'm':
+            metrics_port = atoi(optarg);
+            break;
+        default:
+            capacity = 0;
+        }
+    }
+
+    upstream_count = (argc - optind) / 2;
+    if ((argc - optind) % 2 || upstream_count < 1 ||
+        upstream_count > MAX_UPSTREAMS || capacity < 1 || grace < 0 ||
+        metrics_port < 0) {
+        fprintf(stderr, "usage: %s [-c capacity] [-s grace] [-u] "
+            "[-m metrics_port] ip port [ip port ...]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Each upstream is an IPv4 address followed by its port
+    for (i = 0; i < upstream_count; i++) {
+        upstreams[i].ip = argv[optind + 2*i];
+        upstreams[i].port = atoi(argv[optind + 2*i + 1]);
+    }
 
-    // arg1 is the IPv4 address, arg2 is the port
-    run_server(argv[1], atoi(argv[2]));
+    run_server(upstreams, upstream_count, capacity, grace, use_ring,
+        metrics_port);
 
     return 0;
 }
@@ -1,157 +1,467 @@
 #include "message.h"
 
-// Stores a query/response in a struct
-Message *create_msg(unsigned char *buffer, int size) {
-    Message *msg = malloc(sizeof(*msg));
-    Header *hdr = NULL;
-    Question **qn_list = NULL;
-    Answer **ans_list = NULL;
-    int pos = 0; // Initialise to start of buffer
-
+#define POINTER_SIZE 2      // Size of a compression pointer
+#define MAX_POINTER 0x3fff  // Furthest offset a compression pointer reaches
+#define SOA_FIXED_SIZE 20   // Serial, refresh, retry, expire and minimum
+#define MX_FIXED_SIZE 2     // Preference before the exchange name
+
+// Allocates a message with room for a buffer of the given size
+Message *alloc_msg(int size) {
+    Message *msg = malloc(sizeof(*msg) + size);
     assert(msg);
-    
-    hdr = create_hdr(buffer, &pos);
 
-    memcpy(&msg->qn_count, &hdr->qns, sizeof(int));
-    msg->qn_count = (int)ntohs((int)msg->qn_count);
-    memcpy(&msg->ans_count, &hdr->ans_rr, sizeof(int));
-    msg->ans_count = (int)ntohs((int)msg->ans_count);
-    
-    qn_list = create_qn_list(buffer, &pos, msg->qn_count);
-    ans_list = create_ans_list(buffer, &pos, msg->ans_count);
+    msg->buffer = msg->data;
+    msg->size = size;
+
+    return msg;
+}
+
+// Stores a copy of a query/response in a single allocation
+Message *create_msg(unsigned char *buffer, int size) {
+    Message *msg = alloc_msg(size);
 
-    msg->add_len = size - pos;
-    msg->add = get_n_bytes(buffer, &pos, msg->add_len);
+    memcpy(msg->data, buffer, size);
 
-    msg->hdr = hdr;
-    msg->qn_list = qn_list;
-    msg->ans_list = ans_list;
+    if (parse_msg(msg, msg->data, size) < 0) {
+        free(msg);
+        return NULL;
+    }
 
     return msg;
 }
 
-// Reads and stores header of dns message
-Header *create_hdr(unsigned char *buffer, int *pos) {
-    Header *hdr = malloc(sizeof(*hdr));
-    assert(hdr);
+// Copies a message into a single allocation of its own
+Message *copy_msg(Message *msg) {
+    Message *copy = alloc_msg(msg->size);
+
+    memcpy(copy, msg, sizeof(*msg));
+    memcpy(copy->data, msg->buffer, msg->size);
+    copy->buffer = copy->data;
+
+    return copy;
+}
+
+// Indexes the query/response held in buffer without copying it
+int parse_msg(Message *msg, unsigned char *buffer, int size) {
+    int pos = QDCOUNT_OFF; // Initialise to the counts in the header
+
+    msg->buffer = buffer;
+    msg->size = size;
+
+    if (size < HEADER_SIZE) {
+        return -1;
+    }
+
+    msg->qn_count = get_two_bytes(buffer, &pos);
+    msg->ans_count = get_two_bytes(buffer, &pos);
+    msg->athr_count = get_two_bytes(buffer, &pos);
+    msg->add_count = get_two_bytes(buffer, &pos);
 
-    hdr->id = get_two_bytes(buffer, pos);
-    hdr->flgs = get_two_bytes(buffer, pos);
-    hdr->qns = get_two_bytes(buffer, pos);
-    hdr->ans_rr = get_two_bytes(buffer, pos);
-    hdr->athr_rr = get_two_bytes(buffer, pos);
-    hdr->add_rr = get_two_bytes(buffer, pos);
+    if (msg->qn_count < 1 || parse_qn(msg, &pos) < 0) {
+        return -1;
+    }
+    msg->qn_end = pos;
 
-    return hdr;
+    return parse_records(msg, &pos);
 }
 
-// Reads and stores questions in the dns message
-Question **create_qn_list(unsigned char *buffer, int *pos, int count) {
-    Question **qn_list = malloc(count*sizeof(Question*)), *qn = NULL;
-    assert(qn_list);
+// Reads and indexes the first question, skipping any others
+int parse_qn(Message *msg, int *pos) {
     int i;
 
+    if (parse_name(msg->buffer, msg->size, pos, &msg->qn.name) < 0 ||
+        *pos + 4 > msg->size) {
+        return -1;
+    }
+    msg->qn.qtype = get_two_bytes(msg->buffer, pos);
+    msg->qn.qclass = get_two_bytes(msg->buffer, pos);
+
+    for (i = 1; i < msg->qn_count; i++) {
+        if (skip_name(msg->buffer, msg->size, pos) < 0 ||
+            *pos + 4 > msg->size) {
+            return -1;
+        }
+        *pos += 4;
+    }
+
+    return 0;
+}
+
+// Reads the labels of an uncompressed domain name. Questions come first, so
+// a pointer in one could only reach the header and is rejected
+int parse_name(unsigned char *buffer, int size, int *pos, Name *name) {
+    u_int8_t len;
+
+    name->off = *pos;
+    name->label_count = 0;
+    name->size = 0;
+
+    do {
+        if (*pos >= size) {
+            return -1;
+        }
+
+        len = buffer[*pos];
+        if (len & POINTER_MASK || *pos + 1 + len > size) {
+            return -1;
+        } else if (len) {
+            if (name->label_count == MAX_LABELS) {
+                return -1;
+            }
+            name->label_off[name->label_count++] = *pos;
+            name->size += len;
+        }
+
+        *pos += 1 + len;
+    } while (len);
+
+    name->len = *pos - name->off;
+
+    if (name->len > MAX_NAME_LEN) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Skips over a domain name that may end in a compression pointer
+int skip_name(unsigned char *buffer, int size, int *pos) {
+    u_int8_t len;
+
+    while (*pos < size) {
+        len = buffer[*pos];
+
+        if ((len & POINTER_MASK) == POINTER_MASK) {
+            *pos += POINTER_SIZE;
+            return *pos <= size ? 0 : -1;
+        } else if (len & POINTER_MASK) {
+            return -1;
+        }
+
+        *pos += 1 + len;
+        if (!len) {
+            return *pos <= size ? 0 : -1;
+        }
+    }
+
+    return -1;
+}
+
+// Reads and indexes the resource records of all sections
+int parse_records(Message *msg, int *pos) {
+    Record *rr = NULL, unindexed;
+    int i, count = msg->ans_count + msg->athr_count + msg->add_count;
+
+    msg->rr_count = 0;
+
     for (i = 0; i < count; i++) {
-        qn = malloc(sizeof(*qn));
-        qn->name = malloc(sizeof(qn->name));
-        assert(qn);
-        assert(qn->name);
+        rr = msg->rr_count < MAX_RECORDS ?
+            &msg->rr_list[msg->rr_count] : &unindexed;
 
-        get_qname(qn, buffer, pos);
-        qn->qtype = get_two_bytes(buffer, pos);
-        qn->qclass = get_two_bytes(buffer, pos);
+        rr->off = *pos;
+        if (skip_name(msg->buffer, msg->size, pos) < 0 ||
+            *pos + RR_FIXED_SIZE > msg->size) {
+            return -1;
+        }
+
+        rr->type = get_two_bytes(msg->buffer, pos);
+        rr->rrclass = get_two_bytes(msg->buffer, pos);
+        rr->ttl_off = *pos;
+        rr->ttl = get_four_bytes(msg->buffer, pos);
+        rr->rdata_len = get_two_bytes(msg->buffer, pos);
+        rr->rdata_off = *pos;
+
+        if (*pos + rr->rdata_len > msg->size) {
+            return -1;
+        }
+        *pos += rr->rdata_len;
 
-        qn_list[i] = qn;
+        // Records past the limit are checked but not indexed
+        if (msg->rr_count < MAX_RECORDS) {
+            msg->rr_count++;
+        }
     }
 
-    return qn_list;
+    return 0;
 }
 
-// Gets the entire domain name specified in the qname
-void get_qname(Question *qn, unsigned char *buffer, int *pos) {
-    Name_Section *sec = NULL;
+// Reads a domain name that may be compressed into name as its uncompressed
+// labels, leaving pos after it. Returns its length, or -1 if it is invalid
+int read_name(unsigned char *buffer, int size, int *pos, unsigned char *name) {
+    int off = *pos, start = *pos, len, name_len = 0, jumped = 0;
 
-    // Initialise to empty
-    qn->name_count = 0;
-    qn->name_size = 0;
+    while (1) {
+        if (off >= size) {
+            return -1;
+        }
 
-    do {
-        sec = create_section(buffer, pos);
-        qn->name_count++;
-        qn->name_size += sec->label_len;
+        len = buffer[off];
+        if ((len & POINTER_MASK) == POINTER_MASK) {
+            if (off + POINTER_SIZE > size) {
+                return -1;
+            } else if (!jumped) {
+                *pos = off + POINTER_SIZE;
+                jumped = 1;
+            }
+
+            // Pointing only before the labels just read, so the name ends
+            len = ((len & ~POINTER_MASK) << 8) | buffer[off + 1];
+            if (len >= start) {
+                return -1;
+            }
+            off = start = len;
+            continue;
+        } else if (len & POINTER_MASK || off + 1 + len > size ||
+            name_len + 1 + len > MAX_NAME_LEN) {
+            return -1;
+        }
 
-        qn->name = realloc(qn->name, qn->name_count*sizeof(Name_Section*));
-        qn->name[qn->name_count - 1] = sec;
-    } while (sec->label);
+        memcpy(name + name_len, buffer + off, 1 + len);
+        name_len += 1 + len;
+        off += 1 + len;
+
+        if (!len) {
+            break;
+        }
+    }
+
+    if (!jumped) {
+        *pos = off;
+    }
+
+    return name_len;
 }
 
-// Creates section of the name in a question
-Name_Section *create_section(unsigned char *buffer, int *pos) {
-    Name_Section *sec = malloc(sizeof(*sec));
-    assert(sec);
+// Writes an uncompressed name at pos, pointing at the longest suffix already
+// written. Returns the position after it, or -1 if it passes limit
+int write_name(Name_Table *table, unsigned char *name, int pos, int limit) {
+    u_int16_t written[MAX_LABELS];
+    int i = 0, j, len, count = 0;
+
+    while ((len = name[i])) {
+        for (j = 0; j < table->count; j++) {
+            if (match_name(table->buffer, table->off[j], name + i)) {
+                break;
+            }
+        }
 
-    sec->len = get_one_byte(buffer, pos);
-    memcpy(&sec->label_len, (u_int8_t*)&sec->len, sizeof(u_int8_t));
+        // The rest of the name has been written before
+        if (j < table->count) {
+            if (pos + POINTER_SIZE > limit) {
+                return -1;
+            }
+            put_two_bytes(table->buffer, pos,
+                (POINTER_MASK << 8) | table->off[j]);
+            pos += POINTER_SIZE;
+            break;
+        }
 
-    // Checks if zero byte
-    if (sec->label_len == 0) {
-        sec->label = NULL;
-        return sec;
+        if (pos + 1 + len > limit) {
+            return -1;
+        } else if (pos <= MAX_POINTER) {
+            written[count++] = pos;
+        }
+        memcpy(table->buffer + pos, name + i, 1 + len);
+        pos += 1 + len;
+        i += 1 + len;
+    }
+
+    if (!len) {
+        if (pos + 1 > limit) {
+            return -1;
+        }
+        table->buffer[pos++] = 0;
     }
 
-    sec->label = get_n_bytes(buffer, pos, sec->label_len);
+    // Only offered to later names once whole, as matching reads to the end
+    for (j = 0; j < count && table->count < MAX_SUFFIXES; j++) {
+        table->off[table->count++] = written[j];
+    }
 
-    return sec;
+    return pos;
 }
 
-// Reads and stores answers in the dns message
-Answer **create_ans_list(unsigned char *buffer, int *pos, int count) {
-    Answer **ans_list = malloc(count*sizeof(Answer*)), *ans = NULL;
-    assert(ans_list);
-    int i;
+// Checks if the name written at off, following any pointers, is the same as
+// the uncompressed name
+int match_name(unsigned char *buffer, int off, unsigned char *name) {
+    int i = 0, len;
+
+    // Written names only point back at whole names, so this ends
+    while (1) {
+        len = buffer[off];
+        if ((len & POINTER_MASK) == POINTER_MASK) {
+            off = ((len & ~POINTER_MASK) << 8) | buffer[off + 1];
+            continue;
+        } else if (len != name[i] ||
+            memcmp(buffer + off + 1, name + i + 1, len)) {
+            return 0;
+        } else if (!len) {
+            return 1;
+        }
 
-    for (i = 0; i < count; i++) {
-        ans = malloc(sizeof(*ans));
-        assert(ans);
+        off += 1 + len;
+        i += 1 + len;
+    }
+}
+
+// Writes the rdata of a record at pos, compressing the names of the types
+// RFC 1035 defines. Returns the position after it, or -1 if it passes limit
+int write_rdata(Name_Table *table, Message *msg, Record *rr, int pos,
+    int limit) {
+    unsigned char name[MAX_NAME_LEN];
+    int off = rr->rdata_off, end = rr->rdata_off + rr->rdata_len;
+    int names = 0, fixed_before = 0, fixed_after = 0, i;
+
+    if (rr->type == NS || rr->type == CNAME || rr->type == PTR) {
+        names = 1;
+    } else if (rr->type == MX) {
+        fixed_before = MX_FIXED_SIZE;
+        names = 1;
+    } else if (rr->type == SOA) {
+        names = 2;
+        fixed_after = SOA_FIXED_SIZE;
+    } else {
+        // Other types are copied as they are (RFC 3597 4)
+        fixed_before = rr->rdata_len;
+    }
+
+    if (off + fixed_before > end || pos + fixed_before > limit) {
+        return -1;
+    }
+    memcpy(table->buffer + pos, msg->buffer + off, fixed_before);
+    off += fixed_before;
+    pos += fixed_before;
+
+    for (i = 0; i < names; i++) {
+        if (read_name(msg->buffer, end, &off, name) < 0 ||
+            (pos = write_name(table, name, pos, limit)) < 0) {
+            return -1;
+        }
+    }
 
-        ans->name = get_two_bytes(buffer, pos);
-        ans->type = get_two_bytes(buffer, pos);
-        ans->rrclass = get_two_bytes(buffer, pos);
-        ans->ttl = get_four_bytes(buffer, pos);
-        ans->rd_len = get_two_bytes(buffer, pos);
+    // Anything but exactly the fields of the type is not rewritten
+    if (off + fixed_after != end || pos + fixed_after > limit) {
+        return -1;
+    }
+    memcpy(table->buffer + pos, msg->buffer + off, fixed_after);
+
+    return pos + fixed_after;
+}
+
+// Rewrites the message with its names compressed (RFC 1035 4.1.4), freeing
+// the original. Keeps the original if it would not get smaller
+Message *compress_msg(Message *msg) {
+    unsigned char name[MAX_NAME_LEN];
+    Message *packed = NULL;
+    Name_Table table;
+    Record *rr = NULL;
+    int pos, off, rdata_pos, i;
+
+    // Only rewritten when every name in it can be found
+    if (msg->qn_count != 1 || msg->rr_count !=
+        msg->ans_count + msg->athr_count + msg->add_count) {
+        return msg;
+    }
 
-        memcpy(&ans->rdata_len, &ans->rd_len, sizeof(int));
-        ans->rdata_len = (int)ntohs((int)ans->rdata_len);
+    packed = alloc_msg(msg->size);
+    table.buffer = packed->data;
+    table.count = 0;
+    memcpy(packed->data, msg->buffer, HEADER_SIZE);
+
+    // The question comes first, so later names can only point into it
+    pos = write_name(&table, msg->buffer + msg->qn.name.off, HEADER_SIZE,
+        msg->size);
+    if (pos < 0 || pos + 4 > msg->size) {
+        free_msg(packed);
+        return msg;
+    }
+    memcpy(packed->data + pos, msg->buffer + msg->qn.name.off +
+        msg->qn.name.len, 4);
+    pos += 4;
+
+    for (i = 0; i < msg->rr_count; i++) {
+        rr = &msg->rr_list[i];
+        off = rr->off;
+
+        // Type, class and ttl follow the owner, the rdata its new length
+        if (read_name(msg->buffer, msg->size, &off, name) < 0 ||
+            (pos = write_name(&table, name, pos, msg->size)) < 0 ||
+            pos + RR_FIXED_SIZE > msg->size) {
+            pos = -1;
+            break;
+        }
+        memcpy(packed->data + pos, msg->buffer + off, RR_FIXED_SIZE);
+        rdata_pos = pos + RR_FIXED_SIZE;
 
-        ans->rdata = get_n_bytes(buffer, pos, ans->rdata_len);
+        if ((pos = write_rdata(&table, msg, rr, rdata_pos, msg->size)) < 0) {
+            break;
+        }
+        put_two_bytes(packed->data, rdata_pos - 2, pos - rdata_pos);
+    }
 
-        ans_list[i] = ans;
+    if (pos < 0 || pos >= msg->size || parse_msg(packed, packed->data,
+        pos) < 0) {
+        free_msg(packed);
+        return msg;
     }
 
-    return ans_list;
+    free_msg(msg);
+    return packed;
 }
 
 // Extracts the domain name from the raw data
-char *get_domain(Message *msg) {
-    char *dmn;
-    int i;
-
-    // Only one question in message - domain in first question
-    dmn = malloc(msg->qn_list[0]->name_size + msg->qn_list[0]->name_count);
-    memset(dmn, 0, msg->qn_list[0]->name_size + msg->qn_list[0]->name_count);
-    assert(dmn);
+void get_domain(Message *msg, char *dmn) {
+    get_wire_domain(msg->buffer + msg->qn.name.off, dmn);
+}
 
-    // Last value in name_count is for zero byte
-    for (i = 0; i < msg->qn_list[0]->name_count - 1; i++) {
-        strcat(dmn, (char*)msg->qn_list[0]->name[i]->label);
+// Extracts the domain name from an uncompressed name on the wire
+void get_wire_domain(unsigned char *name, char *dmn) {
+    int i = 0, pos = 0, len;
 
+    while ((len = name[i])) {
         // Separates each section of the domain name
-        if (i < msg->qn_list[0]->name_count - 2) {
-            strcat(dmn, ".");
+        if (pos > 0) {
+            dmn[pos++] = '.';
         }
+        memcpy(dmn + pos, name + i + 1, len);
+        pos += len;
+        i += 1 + len;
     }
 
-    return dmn;
+    dmn[pos] = '\0';
+}
+
+// Gets the transaction ID of the message
+u_int16_t get_id(Message *msg) {
+    int pos = ID_OFF;
+    return get_two_bytes(msg->buffer, &pos);
+}
+
+// Sets the transaction ID of the message
+void set_id(Message *msg, u_int16_t id) {
+    put_two_bytes(msg->buffer, ID_OFF, id);
+}
+
+// Gets the flags of the message
+u_int16_t get_flags(Message *msg) {
+    int pos = FLAGS_OFF;
+    return get_two_bytes(msg->buffer, &pos);
+}
+
+// Sets the flags of the message
+void set_flags(Message *msg, u_int16_t flgs) {
+    put_two_bytes(msg->buffer, FLAGS_OFF, flgs);
+}
+
+// Gets the rdata of a record
+unsigned char *get_rdata(Message *msg, int i) {
+    return msg->buffer + msg->rr_list[i].rdata_off;
+}
+
+// Sets the ttl of a record
+void set_ttl(Message *msg, int i, u_int32_t ttl) {
+    msg->rr_list[i].ttl = ttl;
+    put_four_bytes(msg->buffer, msg->rr_list[i].ttl_off, ttl);
 }
 
 // Reads one byte from the buffer
@@ -162,77 +472,35 @@ u_int8_t get_one_byte(unsigned char *buffer, int *pos) {
     return result;
 }
 
-// Reads two bytes from the buffer
+// Reads two bytes from the buffer in host byte order
 u_int16_t get_two_bytes(unsigned char *buffer, int *pos) {
     u_int16_t result;
     memcpy(&result, &buffer[*pos], sizeof(u_int16_t));
     *pos += 2; // Moves position in buffer up by two
-    return result;
+    return ntohs(result);
 }
 
-// Reads four bytes from the buffer
+// Reads four bytes from the buffer in host byte order
 u_int32_t get_four_bytes(unsigned char *buffer, int *pos) {
     u_int32_t result;
     memcpy(&result, &buffer[*pos], sizeof(u_int32_t));
     *pos += 4; // Moves position in buffer up by four
-    return result;
+    return ntohl(result);
 }
 
-// Reads n bytes from the buffer
-unsigned char *get_n_bytes(unsigned char *buffer, int *pos, int n) {
-    // Allocates space for n bytes + null byte
-    unsigned char *result = malloc(n + 1);
-    memset(result, 0, n + 1);
-    assert(result);
-
-    memcpy(result, &buffer[*pos], n);
-    *pos += n;
+// Writes two bytes into the buffer in network byte order
+void put_two_bytes(unsigned char *buffer, int pos, u_int16_t value) {
+    value = htons(value);
+    memcpy(&buffer[pos], &value, sizeof(u_int16_t));
+}
 
-    return result;
+// Writes four bytes into the buffer in network byte order
+void put_four_bytes(unsigned char *buffer, int pos, u_int32_t value) {
+    value = htonl(value);
+    memcpy(&buffer[pos], &value, sizeof(u_int32_t));
 }
 
 // Frees memory allocated for a message
 void free_msg(Message *msg) {
-    free(msg->hdr);
-    free_qn(msg->qn_list, msg->qn_count);
-    free_ans(msg->ans_list, msg->ans_count);
-    free(msg->add);
     free(msg);
 }
-
-// Frees memory allocated for the message questions
-void free_qn(Question **qn_list, int qn_count) {
-    int i;
-
-    for (i = 0; i < qn_count; i++) {
-        free_qname(qn_list[i]);
-        free(qn_list[i]);
-    }
-
-    free(qn_list);
-}
-
-// Frees memory allocated for the message question labels
-void free_qname(Question *qn) {
-    int i;
-
-    // Frees all labels except for zero byte
-    for (i = 0; i < qn->name_count - 1; i++) {
-        free(qn->name[i]->label);
-        free(qn->name[i]);
-    }
-
-    free(qn->name);
-}
-
-// Frees memory allocated for the message answers
-void free_ans(Answer **ans_list, int ans_count) {
-    int i;
-
-    for (i = 0; i < ans_count; i++) {
-        free(ans_list[i]->rdata);
-        free(ans_list[i]);
-    }
-
-    free(ans_list);
-}
@@ -8,106 +8,177 @@
 #include <string.h>
 #include <arpa/inet.h>
 
-// Header struct for DNS query/response
+#define HEADER_SIZE 12      // Size of DNS header
+#define RR_FIXED_SIZE 10    // Size of type, class, ttl and rdata length of RR
+#define MAX_LABELS 128      // Most labels a domain name can hold
+#define MAX_RECORDS 64      // Most resource records indexed per message
+#define MAX_NAME_LEN 255    // Longest domain name on the wire
+#define DOMAIN_LEN 256      // Longest domain name as text, with null byte
+#define OPT 41              // IANA assigned value for EDNS OPT pseudo-record
+#define SOA 6               // IANA assigned value for SOA record type
+#define AAAA 28             // IANA assigned value for AAAA record type
+#define NS 2                // IANA assigned value for NS record type
+#define CNAME 5             // IANA assigned value for CNAME record type
+#define PTR 12              // IANA assigned value for PTR record type
+#define MX 15               // IANA assigned value for MX record type
+#define POINTER_MASK 0xc0   // Top bits of a compression pointer
+#define MAX_SUFFIXES 64     // Names remembered for compressing later ones
+
+// Offsets of the header fields
+#define ID_OFF 0
+#define FLAGS_OFF 2
+#define QDCOUNT_OFF 4
+#define ANCOUNT_OFF 6
+#define NSCOUNT_OFF 8
+#define ARCOUNT_OFF 10
+
+// Domain name, as the offsets of its labels in the buffer
 typedef struct {
-    u_int16_t id;
-    u_int16_t flgs;
-    u_int16_t qns;
-    u_int16_t ans_rr;
-    u_int16_t athr_rr;
-    u_int16_t add_rr;
-} Header;
-
-// Name struct for each section of the name in a question
-typedef struct {
-    u_int8_t len;
-    unsigned char *label;
+    int off;
+    int len;            // Length on the wire, including the zero byte
+    int label_count;    // Excluding the zero byte
+    int size;           // Total length of the labels
 
-    u_int8_t label_len;
-} Name_Section;
+    // Offset of the length byte of each label
+    u_int16_t label_off[MAX_LABELS];
+} Name;
 
 // Question struct for DNS query/response
 typedef struct {
-    Name_Section **name;
-    int name_count;
-    int name_size;
+    Name name;
 
     u_int16_t qtype;
     u_int16_t qclass;
 } Question;
 
-// Answer struct for DNS response
+// Resource record struct for DNS response, fields in host byte order
 typedef struct {
-    u_int16_t name;
+    u_int16_t off;      // Offset of the owner name
     u_int16_t type;
     u_int16_t rrclass;
     u_int32_t ttl;
 
-    u_int16_t rd_len;
-    unsigned char *rdata;
+    u_int16_t ttl_off;
+    u_int16_t rdata_off;
+    u_int16_t rdata_len;
+} Record;
 
-    int rdata_len;
-} Answer;
+// Offsets of the names written into a message so far, each of which later
+// names can point at instead of repeating it
+typedef struct {
+    unsigned char *buffer;
+    u_int16_t off[MAX_SUFFIXES];
+    int count;
+} Name_Table;
 
-// Message struct for DNS query/response
+// Message struct for DNS query/response, a view over its wire bytes
 typedef struct {
-    u_int16_t tcp_hdr;
+    unsigned char *buffer;
     int size;
 
-    Header *hdr;
-    Question **qn_list;
-    Answer **ans_list;
-
     int qn_count;
     int ans_count;
+    int athr_count;
+    int add_count;
 
-    unsigned char *add;
-    int add_len;
+    // Only the first question is kept, the only one answered
+    Question qn;
+    int qn_end;
+
+    // Answers, then authority, then additional records
+    Record rr_list[MAX_RECORDS];
+    int rr_count;
+
+    // Holds the buffer of messages made by create_msg
+    unsigned char data[];
 } Message;
 
-// Stores a query/response in a struct
+// Allocates a message with room for a buffer of the given size
+Message *alloc_msg(int size);
+
+// Stores a copy of a query/response in a single allocation
 Message *create_msg(unsigned char *buffer, int size);
 
-// Reads and stores header of dns message
-Header *create_hdr(unsigned char *buffer, int *pos);
+// Copies a message into a single allocation of its own
+Message *copy_msg(Message *msg);
+
+// Indexes the query/response held in buffer without copying it
+int parse_msg(Message *msg, unsigned char *buffer, int size);
+
+// Reads and indexes the first question, skipping any others
+int parse_qn(Message *msg, int *pos);
+
+// Reads the labels of an uncompressed domain name. Questions come first, so
+// a pointer in one could only reach the header and is rejected
+int parse_name(unsigned char *buffer, int size, int *pos, Name *name);
+
+// Skips over a domain name that may end in a compression pointer
+int skip_name(unsigned char *buffer, int size, int *pos);
+
+// Reads and indexes the resource records of all sections
+int parse_records(Message *msg, int *pos);
+
+// Reads a domain name that may be compressed into name as its uncompressed
+// labels, leaving pos after it. Returns its length, or -1 if it is invalid
+int read_name(unsigned char *buffer, int size, int *pos, unsigned char *name);
 
-// Reads and stores questions in the dns message
-Question **create_qn_list(unsigned char *buffer, int *pos, int count);
+// Writes an uncompressed name at pos, pointing at the longest suffix already
+// written. Returns the position after it, or -1 if it passes limit
+int write_name(Name_Table *table, unsigned char *name, int pos, int limit);
 
-// Gets the entire domain name specified in the qname
-void get_qname(Question *qn, unsigned char *buffer, int *pos);
+// Checks if the name written at off, following any pointers, is the same as
+// the uncompressed name
+int match_name(unsigned char *buffer, int off, unsigned char *name);
 
-// Creates section of the name in a question
-Name_Section *create_section(unsigned char *buffer, int *pos);
+// Writes the rdata of a record at pos, compressing the names of the types
+// RFC 1035 defines. Returns the position after it, or -1 if it passes limit
+int write_rdata(Name_Table *table, Message *msg, Record *rr, int pos,
+    int limit);
 
-// Reads and stores answers in the dns message
-Answer **create_ans_list(unsigned char *buffer, int *pos, int count);
+// Rewrites the message with its names compressed (RFC 1035 4.1.4), freeing
+// the original. Keeps the original if it would not get smaller
+Message *compress_msg(Message *msg);
 
 // Extracts the domain name from the raw data
-char *get_domain(Message *msg);
+void get_domain(Message *msg, char *dmn);
+
+// Extracts the domain name from an uncompressed name on the wire
+void get_wire_domain(unsigned char *name, char *dmn);
+
+// Gets the transaction ID of the message
+u_int16_t get_id(Message *msg);
+
+// Sets the transaction ID of the message
+void set_id(Message *msg, u_int16_t id);
+
+// Gets the flags of the message
+u_int16_t get_flags(Message *msg);
+
+// Sets the flags of the message
+void set_flags(Message *msg, u_int16_t flgs);
+
+// Gets the rdata of a record
+unsigned char *get_rdata(Message *msg, int i);
+
+// Sets the ttl of a record
+void set_ttl(Message *msg, int i, u_int32_t ttl);
 
 // Reads one byte from the buffer
 u_int8_t get_one_byte(unsigned char *buffer, int *pos);
 
-// Reads two bytes from the buffer
+// Reads two bytes from the buffer in host byte order
 u_int16_t get_two_bytes(unsigned char *buffer, int *pos);
 
-// Reads four bytes from the buffer
+// Reads four bytes from the buffer in host byte order
 u_int32_t get_four_bytes(unsigned char *buffer, int *pos);
 
-// Reads n bytes from the buffer
-unsigned char *get_n_bytes(unsigned char *buffer, int *pos, int n);
+// Writes two bytes into the buffer in network byte order
+void put_two_bytes(unsigned char *buffer, int pos, u_int16_t value);
+
+// Writes four bytes into the buffer in network byte order
+void put_four_bytes(unsigned char *buffer, int pos, u_int32_t value);
 
 // Frees memory allocated for the message
 void free_msg(Message *msg);
 
-// Frees memory allocated for the message questions
-void free_qn(Question **qn_list, int qn_count);
-
-// Frees memory allocated for the message question labels
-void free_qname(Question *qn);
-
-// Frees memory allocated for the message answers
-void free_ans(Answer **ans_list, int ans_count);
-
 #endif
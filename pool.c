@@ -0,0 +1,324 @@
+#include "pool.h"
+
+#define ON 1                        // Keeps reading responses
+#define TCP_HEADER_SIZE 2           // Size of TCP header
+#define IN_BUFFER_SIZE (65535 + TCP_HEADER_SIZE)   // Fits any response
+#define OUT_BUFFER_SIZE 4096        // Initial size of the write buffer
+#define ID_GENERATIONS (65536 / MAX_INFLIGHT)      // IDs sharing a slot
+
+// Creates an upstream connection, opened on its first query
+Upstream *create_upstream(const char *ip, const int port, int epfd,
+    void *tag, Response_Handler handler, void *arg) {
+    Upstream *up = malloc(sizeof(*up));
+    int i;
+
+    assert(up);
+    memset(up, 0, sizeof(*up));
+
+    up->sockfd = -1;
+    up->ip = ip;
+    up->port = port;
+    up->epfd = epfd;
+    up->tag = tag;
+    up->handler = handler;
+    up->arg = arg;
+
+    // Hands out low slots first
+    for (i = 0; i < MAX_INFLIGHT; i++) {
+        up->free_slots[i] = MAX_INFLIGHT - 1 - i;
+    }
+    up->free_count = MAX_INFLIGHT;
+
+    up->out_size = OUT_BUFFER_SIZE;
+    up->out = malloc(up->out_size);
+    up->in = malloc(IN_BUFFER_SIZE);
+    assert(up->out);
+    assert(up->in);
+
+    return up;
+}
+
+// Gets the number of queries waiting for a response
+int count_inflight(Upstream *up) {
+    return MAX_INFLIGHT - up->free_count;
+}
+
+// Pipelines a query upstream under a new transaction ID, setting slot to
+// the one it holds before it can be answered
+int send_upstream(Upstream *up, unsigned char *buffer, int len, void *owner,
+    int *slot) {
+    Pending *pending = NULL;
+
+    if (up->free_count == 0) {
+        return -1;
+    } else if (up->sockfd < 0 && connect_upstream(up) < 0) {
+        return -1;
+    }
+
+    // The slot is kept in the low bits of the ID, so the response finds it
+    // directly, and the generation in the high bits catches stale responses
+    *slot = up->free_slots[--up->free_count];
+    pending = &up->pending[*slot];
+    pending->owner = owner;
+    pending->id = (u_int16_t)((up->gen++ % ID_GENERATIONS) * MAX_INFLIGHT +
+        *slot);
+    pending->retries = 0;
+    pending->len = len;
+    pending->query = malloc(len);
+    assert(pending->query);
+    memcpy(pending->query, buffer, len);
+
+    queue_query(up, pending);
+
+    if (up->connected && flush_upstream(up) < 0) {
+        reset_upstream(up);
+    }
+
+    return 0;
+}
+
+// Handles an event on the upstream socket
+void handle_upstream(Upstream *up, u_int32_t events) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+
+    if (up->sockfd < 0) {
+        return;
+    }
+
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        reset_upstream(up);
+        return;
+    }
+
+    // Connected once the peer address is known
+    if (!up->connected) {
+        if (!(events & EPOLLOUT)) {
+            return;
+        } else if (getpeername(up->sockfd, (struct sockaddr*)&addr,
+            &len) < 0) {
+            reset_upstream(up);
+            return;
+        }
+        up->connected = 1;
+    }
+
+    if (flush_upstream(up) < 0 || read_upstream(up) < 0) {
+        reset_upstream(up);
+    }
+}
+
+// Opens the connection to the upstream
+int connect_upstream(Upstream *up) {
+    struct sockaddr_in addr;
+    struct epoll_event event;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(up->ip);
+    addr.sin_port = htons(up->port);
+
+    // Opens a non-blocking socket to server
+    if ((up->sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    // Starts connecting to server, completion is reported by the event loop
+    if (connect(up->sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0 &&
+        errno != EINPROGRESS) {
+        perror("connect");
+        close(up->sockfd);
+        up->sockfd = -1;
+        return -1;
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    event.data.ptr = up->tag;
+
+    if (epoll_ctl(up->epfd, EPOLL_CTL_ADD, up->sockfd, &event) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+
+    up->connected = 0;
+    up->in_len = 0;
+
+    return 0;
+}
+
+// Writes as many queued queries as the socket accepts
+int flush_upstream(Upstream *up) {
+    int status;
+
+    while (up->out_pos < up->out_len) {
+        status = write(up->sockfd, up->out + up->out_pos,
+            up->out_len - up->out_pos);
+        if (status < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // Resumed when the socket reports it is writable again
+                return 0;
+            }
+            perror("write");
+            return -1;
+        }
+        up->out_pos += status;
+    }
+
+    up->out_pos = 0;
+    up->out_len = 0;
+
+    return 0;
+}
+
+// Reads and dispatches every complete response
+int read_upstream(Upstream *up) {
+    Pending *pending = NULL;
+    int status, size, pos, slot;
+    unsigned long resets = up->resets;
+    u_int16_t id;
+    void *owner;
+
+    while (ON) {
+        status = read(up->sockfd, up->in + up->in_len,
+            IN_BUFFER_SIZE - up->in_len);
+        if (status == 0) {
+            // Upstream closed the connection
+            return -1;
+        } else if (status < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            perror("read");
+            return -1;
+        }
+        up->in_len += status;
+
+        // Dispatches every complete length-prefixed response in the buffer
+        pos = 0;
+        while (up->in_len - pos >= TCP_HEADER_SIZE) {
+            size = (up->in[pos] << 8) | up->in[pos + 1];
+            if (up->in_len - pos - TCP_HEADER_SIZE < size) {
+                break;
+            }
+            pos += TCP_HEADER_SIZE;
+
+            if (size >= (int)sizeof(id)) {
+                memcpy(&id, up->in + pos, sizeof(id));
+                id = ntohs(id);
+                slot = id % MAX_INFLIGHT;
+                pending = &up->pending[slot];
+
+                // Ignores responses to queries no longer waiting
+                if (pending->owner && pending->id == id) {
+                    owner = pending->owner;
+                    release_slot(up, slot);
+                    up->handler(up->arg, up, owner, up->in + pos, size);
+
+                    // The handler can send a query on this connection, and
+                    // a failed send resets it, emptying the buffer. What is
+                    // left was resent on the new connection
+                    if (up->resets != resets) {
+                        return 0;
+                    }
+                }
+            }
+            pos += size;
+        }
+
+        memmove(up->in, up->in + pos, up->in_len - pos);
+        up->in_len -= pos;
+    }
+}
+
+// Reopens a failed connection, resending or failing its queries
+void reset_upstream(Upstream *up) {
+    void *owner;
+    int slot, reconnected;
+
+    close(up->sockfd);
+    up->sockfd = -1;
+    up->resets++;
+    up->connected = 0;
+    up->out_pos = 0;
+    up->out_len = 0;
+    up->in_len = 0;
+
+    if (count_inflight(up) == 0) {
+        return;
+    }
+
+    reconnected = connect_upstream(up) == 0;
+
+    // Queries are resent on the new connection under the same IDs
+    for (slot = 0; slot < MAX_INFLIGHT; slot++) {
+        if (!up->pending[slot].owner) {
+            continue;
+        }
+
+        if (reconnected && up->pending[slot].retries < MAX_RETRIES) {
+            up->pending[slot].retries++;
+            queue_query(up, &up->pending[slot]);
+        } else {
+            owner = up->pending[slot].owner;
+            release_slot(up, slot);
+            up->handler(up->arg, up, owner, NULL, 0);
+        }
+    }
+}
+
+// Queues a query for writing with its length prefix and ID
+void queue_query(Upstream *up, Pending *pending) {
+    int needed = up->out_len + TCP_HEADER_SIZE + pending->len;
+    u_int16_t size = htons(pending->len), id = htons(pending->id);
+
+    while (needed > up->out_size) {
+        up->out_size *= 2;
+        up->out = realloc(up->out, up->out_size);
+        assert(up->out);
+    }
+
+    memcpy(up->out + up->out_len, &size, TCP_HEADER_SIZE);
+    memcpy(up->out + up->out_len + TCP_HEADER_SIZE, pending->query,
+        pending->len);
+    memcpy(up->out + up->out_len + TCP_HEADER_SIZE, &id, sizeof(id));
+    up->out_len = needed;
+}
+
+// Frees the query slot so its ID can be reused
+void release_slot(Upstream *up, int slot) {
+    free(up->pending[slot].query);
+    up->pending[slot].query = NULL;
+    up->pending[slot].owner = NULL;
+    up->free_slots[up->free_count++] = slot;
+}
+
+// Stops waiting for the owner's query in the given slot, so a late response
+// is ignored. A slot since freed or handed to another owner is left alone
+void cancel_query(Upstream *up, void *owner, int slot) {
+    if (up->pending[slot].owner == owner) {
+        release_slot(up, slot);
+    }
+}
+
+// Frees memory allocated for the upstream connection
+void free_upstream(Upstream *up) {
+    int slot;
+
+    if (up->sockfd >= 0) {
+        close(up->sockfd);
+    }
+
+    for (slot = 0; slot < MAX_INFLIGHT; slot++) {
+        free(up->pending[slot].query);
+    }
+
+    free(up->out);
+    free(up->in);
+    free(up);
+}
@@ -0,0 +1,114 @@
+#ifndef POOL
+#define POOL
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#define MAX_INFLIGHT 1024   // Queries pipelined on one upstream connection
+#define MAX_RETRIES 1       // Times a query is resent after a reconnect
+
+// Address of an upstream server
+typedef struct {
+    const char *ip;
+    int port;
+} Address;
+
+// Persistent connection to the upstream, shared by many queries
+typedef struct upstream Upstream;
+
+// Called with the response to a query on the connection, or with a NULL
+// buffer if it failed
+typedef void (*Response_Handler)(void *arg, Upstream *up, void *owner,
+    unsigned char *buffer, int size);
+
+// Query waiting for its response on an upstream connection
+typedef struct {
+    void *owner;
+    u_int16_t id;
+
+    // Copy of the query, kept to resend it if the connection drops
+    unsigned char *query;
+    int len;
+    int retries;
+} Pending;
+
+struct upstream {
+    int sockfd;
+    int connected;
+    const char *ip;
+    int port;
+
+    // Event loop the socket is registered with
+    int epfd;
+    void *tag;
+
+    Pending pending[MAX_INFLIGHT];
+    int free_slots[MAX_INFLIGHT];
+    int free_count;
+    u_int16_t gen;
+
+    // Queries waiting to be written
+    unsigned char *out;
+    int out_len;
+    int out_pos;
+    int out_size;
+
+    // Bytes read but not yet handled
+    unsigned char *in;
+    int in_len;
+
+    // Times the connection was reset, so readers notice a handler did it
+    unsigned long resets;
+
+    Response_Handler handler;
+    void *arg;
+};
+
+// Creates an upstream connection, opened on its first query
+Upstream *create_upstream(const char *ip, const int port, int epfd,
+    void *tag, Response_Handler handler, void *arg);
+
+// Gets the number of queries waiting for a response
+int count_inflight(Upstream *up);
+
+// Pipelines a query upstream under a new transaction ID, setting slot to
+// the one it holds before it can be answered
+int send_upstream(Upstream *up, unsigned char *buffer, int len, void *owner,
+    int *slot);
+
+// Handles an event on the upstream socket
+void handle_upstream(Upstream *up, u_int32_t events);
+
+// Opens the connection to the upstream
+int connect_upstream(Upstream *up);
+
+// Writes as many queued queries as the socket accepts
+int flush_upstream(Upstream *up);
+
+// Reads and dispatches every complete response
+int read_upstream(Upstream *up);
+
+// Reopens a failed connection, resending or failing its queries
+void reset_upstream(Upstream *up);
+
+// Queues a query for writing with its length prefix and ID
+void queue_query(Upstream *up, Pending *pending);
+
+// Frees the query slot so its ID can be reused
+void release_slot(Upstream *up, int slot);
+
+// Stops waiting for the owner's query in the given slot, so a late response
+// is ignored. A slot since freed or handed to another owner is left alone
+void cancel_query(Upstream *up, void *owner, int slot);
+
+// Frees memory allocated for the upstream connection
+void free_upstream(Upstream *up);
+
+#endif
@@ -0,0 +1,258 @@
+#include "refresh.h"
+
+#define ON 1                    // Keeps refreshing answers
+#define TCP_HEADER_SIZE 2       // Size of TCP header
+#define MAX_MSG_SIZE 65535      // Largest message after a TCP prefix
+#define RD_FLAG 0x0100          // Asks the upstream to recurse
+#define REFRESH_TIMEOUT 2       // Seconds to wait for the upstream
+
+// Starts the thread refreshing answers of the cache from the upstreams
+Refresher *start_refresher(Cache *cache, Address *upstreams,
+    int upstream_count) {
+    Refresher *refresher = malloc(sizeof(*refresher));
+    pthread_t thread;
+    int i;
+
+    assert(refresher);
+    refresher->cache = cache;
+    refresher->upstream_count = upstream_count;
+    refresher->upstreams = malloc(upstream_count*sizeof(Address));
+    refresher->latency = malloc(upstream_count*sizeof(Latency));
+    assert(refresher->upstreams && refresher->latency);
+    memcpy(refresher->upstreams, upstreams, upstream_count*sizeof(Address));
+    for (i = 0; i < upstream_count; i++) {
+        init_latency(&refresher->latency[i]);
+    }
+    refresher->connected = -1;
+    refresher->sockfd = -1;
+    refresher->id = 0;
+
+    pthread_mutex_init(&refresher->lock, NULL);
+    pthread_cond_init(&refresher->ready, NULL);
+    refresher->head = NULL;
+    refresher->tail = NULL;
+    refresher->count = 0;
+
+    pthread_create(&thread, NULL, run_refresher, refresher);
+    pthread_detach(thread);
+
+    return refresher;
+}
+
+// Queues a query for the question of a cached answer, unless too many are
+// already waiting
+void request_refresh(void *arg, Message *msg) {
+    Refresher *refresher = (Refresher*)arg;
+    Refresh *refresh = NULL;
+    Name *name = &msg->qn.name;
+    int qn_len = name->len + 4; // Name, qtype and qclass
+
+    refresh = malloc(sizeof(*refresh));
+    assert(refresh);
+    refresh->len = HEADER_SIZE + qn_len;
+    refresh->query = malloc(refresh->len);
+    assert(refresh->query);
+    refresh->next = NULL;
+
+    // Asks only the first question, as a fresh recursive query
+    memset(refresh->query, 0, HEADER_SIZE);
+    put_two_bytes(refresh->query, FLAGS_OFF, RD_FLAG);
+    put_two_bytes(refresh->query, QDCOUNT_OFF, 1);
+    memcpy(refresh->query + HEADER_SIZE, msg->buffer + name->off, qn_len);
+    refresh->key_len = make_key(msg, refresh->key);
+
+    pthread_mutex_lock(&refresher->lock);
+    if (refresher->count == MAX_REFRESHES) {
+        pthread_mutex_unlock(&refresher->lock);
+        cancel_refresh(refresher->cache, refresh->key, refresh->key_len);
+        free(refresh->query);
+        free(refresh);
+        return;
+    }
+
+    if (refresher->tail) {
+        refresher->tail->next = refresh;
+    } else {
+        refresher->head = refresh;
+    }
+    refresher->tail = refresh;
+    refresher->count++;
+    pthread_cond_signal(&refresher->ready);
+    pthread_mutex_unlock(&refresher->lock);
+}
+
+// Sends each queued query upstream and caches the answers
+void *run_refresher(void *param) {
+    Refresher *refresher = (Refresher*)param;
+    Refresh *refresh = NULL;
+    Message *msg = NULL;
+
+    while (ON) {
+        pthread_mutex_lock(&refresher->lock);
+        while (!refresher->head) {
+            pthread_cond_wait(&refresher->ready, &refresher->lock);
+        }
+        refresh = refresher->head;
+        refresher->head = refresh->next;
+        if (!refresher->head) {
+            refresher->tail = NULL;
+        }
+        refresher->count--;
+        pthread_mutex_unlock(&refresher->lock);
+
+        // Replaces the cached answer while clients are still served the old,
+        // or else lets a later hit ask again
+        msg = refresh_answer(refresher, refresh);
+        if (msg && check_cacheable(msg)) {
+            cache_item(refresher->cache, msg);
+        } else {
+            cancel_refresh(refresher->cache, refresh->key, refresh->key_len);
+        }
+        if (msg) {
+            free_msg(msg);
+        }
+
+        free(refresh->query);
+        free(refresh);
+    }
+
+    return NULL;
+}
+
+// Asks the upstreams in turn, fastest healthy one first, until one answers.
+// Returns the response or NULL
+Message *refresh_answer(Refresher *refresher, Refresh *refresh) {
+    Message *msg = NULL;
+    unsigned int tried = 0;
+    long sent;
+    int index;
+
+    while ((index = pick_refresh_upstream(refresher, tried)) >= 0) {
+        tried |= 1U << index;
+        sent = get_micros();
+
+        if ((msg = ask_upstream(refresher, index, refresh))) {
+            record_rtt(&refresher->latency[index], get_micros() - sent);
+            return msg;
+        }
+        record_failure(&refresher->latency[index], get_micros());
+    }
+
+    return NULL;
+}
+
+// Gets the healthy upstream with the lowest round trip time among those not
+// in tried, or else any untried one, or -1
+int pick_refresh_upstream(Refresher *refresher, unsigned int tried) {
+    Latency *lat = refresher->latency;
+    long now = get_micros();
+    int i, best = -1, healthy, best_healthy = 0;
+
+    // Upstreams that have not answered yet have no round trip time, so
+    // they are tried first
+    for (i = 0; i < refresher->upstream_count; i++) {
+        if (tried & (1U << i)) {
+            continue;
+        }
+
+        healthy = check_healthy(&lat[i], now);
+        if (best < 0 || healthy > best_healthy ||
+            (healthy == best_healthy && lat[i].srtt < lat[best].srtt)) {
+            best = i;
+            best_healthy = healthy;
+        }
+    }
+
+    return best;
+}
+
+// Sends a query to one upstream and waits for the response, returns it or
+// NULL
+Message *ask_upstream(Refresher *refresher, int index, Refresh *refresh) {
+    static unsigned char buffer[TCP_HEADER_SIZE + MAX_MSG_SIZE];
+    Message *msg = NULL;
+    int size;
+
+    // Moves the connection over to the upstream picked
+    if (refresher->connected != index && refresher->sockfd >= 0) {
+        close(refresher->sockfd);
+        refresher->sockfd = -1;
+    }
+    if (refresher->sockfd < 0 && connect_refresher(refresher, index) < 0) {
+        return NULL;
+    }
+
+    put_two_bytes(buffer, 0, refresh->len);
+    memcpy(buffer + TCP_HEADER_SIZE, refresh->query, refresh->len);
+    put_two_bytes(buffer + TCP_HEADER_SIZE, ID_OFF, ++refresher->id);
+
+    if (write(refresher->sockfd, buffer, TCP_HEADER_SIZE + refresh->len) !=
+        TCP_HEADER_SIZE + refresh->len ||
+        read_exactly(refresher->sockfd, buffer, TCP_HEADER_SIZE) < 0 ||
+        (size = (buffer[0] << 8) | buffer[1]) == 0 ||
+        read_exactly(refresher->sockfd, buffer, size) < 0) {
+        // Reconnects for the next refresh
+        close(refresher->sockfd);
+        refresher->sockfd = -1;
+        return NULL;
+    }
+
+    msg = create_msg(buffer, size);
+    if (msg && get_id(msg) != refresher->id) {
+        free_msg(msg);
+        return NULL;
+    }
+
+    return msg ? compress_msg(msg) : NULL;
+}
+
+// Opens the blocking connection the refresher queries the upstream over
+int connect_refresher(Refresher *refresher, int index) {
+    struct sockaddr_in addr;
+    struct timeval timeout;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(refresher->upstreams[index].ip);
+    addr.sin_port = htons(refresher->upstreams[index].port);
+
+    if ((refresher->sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    // A slow upstream only holds up later refreshes for so long
+    timeout.tv_sec = REFRESH_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(refresher->sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+        sizeof(timeout));
+    setsockopt(refresher->sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+        sizeof(timeout));
+
+    if (connect(refresher->sockfd, (struct sockaddr*)&addr,
+        sizeof(addr)) < 0) {
+        close(refresher->sockfd);
+        refresher->sockfd = -1;
+        return -1;
+    }
+    refresher->connected = index;
+
+    return 0;
+}
+
+// Reads exactly num_bytes from the socket, returns -1 if it fails
+int read_exactly(const int sockfd, unsigned char *buffer, int num_bytes) {
+    int status, bytes_read = 0;
+
+    while (bytes_read < num_bytes) {
+        status = read(sockfd, buffer + bytes_read, num_bytes - bytes_read);
+        if (status < 0 && errno == EINTR) {
+            continue;
+        } else if (status <= 0) {
+            return -1;
+        }
+        bytes_read += status;
+    }
+
+    return 0;
+}
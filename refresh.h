@@ -0,0 +1,79 @@
+#ifndef REFRESH
+#define REFRESH
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "message.h"
+#include "cache.h"
+#include "pool.h"
+#include "latency.h"
+
+#define MAX_REFRESHES 1024  // Refreshes that can wait for the refresher
+
+// Query re-asking the upstream a question whose answer is about to expire
+typedef struct refresh Refresh;
+
+struct refresh {
+    unsigned char *query;
+    int len;
+
+    // Key of the cached item, cleared for another try if this one fails
+    unsigned char key[KEY_SIZE];
+    int key_len;
+
+    Refresh *next;
+};
+
+// Background thread keeping hot answers in the cache fresh, from whichever
+// upstream has been answering it fastest
+typedef struct {
+    Cache *cache;
+    Address *upstreams;
+    Latency *latency;
+    int upstream_count;
+    int connected;      // Upstream the socket is open to, -1 if none
+    int sockfd;
+    u_int16_t id;
+
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    Refresh *head;
+    Refresh *tail;
+    int count;
+} Refresher;
+
+// Starts the thread refreshing answers of the cache from the upstreams
+Refresher *start_refresher(Cache *cache, Address *upstreams,
+    int upstream_count);
+
+// Queues a query for the question of a cached answer, unless too many are
+// already waiting
+void request_refresh(void *arg, Message *msg);
+
+// Sends each queued query upstream and caches the answers
+void *run_refresher(void *param);
+
+// Asks the upstreams in turn, fastest healthy one first, until one answers.
+// Returns the response or NULL
+Message *refresh_answer(Refresher *refresher, Refresh *refresh);
+
+// Gets the healthy upstream with the lowest round trip time among those not
+// in tried, or else any untried one, or -1
+int pick_refresh_upstream(Refresher *refresher, unsigned int tried);
+
+// Sends a query to one upstream and waits for the response, returns it or
+// NULL
+Message *ask_upstream(Refresher *refresher, int index, Refresh *refresh);
+
+// Opens the blocking connection the refresher queries the upstream over
+int connect_refresher(Refresher *refresher, int index);
+
+// Reads exactly num_bytes from the socket, returns -1 if it fails
+int read_exactly(const int sockfd, unsigned char *buffer, int num_bytes);
+
+#endif
@@ -0,0 +1,271 @@
+#include "ring.h"
+
+#define MS_PER_SEC 1000L
+#define NS_PER_MS 1000000L
+
+// Sets up the ring and its receive buffers, returns -1 if io_uring is not
+// available
+int setup_ring(Ring *ring) {
+    struct io_uring_params params;
+    struct io_uring_buf_reg reg;
+    unsigned char *sq_ptr = NULL, *cq_ptr = NULL;
+    unsigned int *array = NULL, i;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+
+    if ((ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES,
+        &params)) < 0) {
+        return -1;
+    }
+
+    // Both queues live in one mapping on kernels that allow it
+    ring->sq_map_size = params.sq_off.array +
+        params.sq_entries*sizeof(unsigned int);
+    ring->cq_map_size = params.cq_off.cqes +
+        params.cq_entries*sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP &&
+        ring->cq_map_size > ring->sq_map_size) {
+        ring->sq_map_size = ring->cq_map_size;
+    }
+
+    sq_ptr = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    ring->sq_map = sq_ptr;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ptr = sq_ptr;
+    } else {
+        cq_ptr = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+            free_ring(ring);
+            return -1;
+        }
+        ring->cq_map = cq_ptr;
+    }
+
+    ring->sqes = mmap(NULL, params.sq_entries*sizeof(struct io_uring_sqe),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+        IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        free_ring(ring);
+        return -1;
+    }
+
+    ring->sq_head = (unsigned int*)(sq_ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned int*)(sq_ptr + params.sq_off.tail);
+    ring->sq_mask = *(unsigned int*)(sq_ptr + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (unsigned int*)(cq_ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned int*)(cq_ptr + params.cq_off.tail);
+    ring->cq_mask = *(unsigned int*)(cq_ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq_ptr + params.cq_off.cqes);
+
+    // Entries are always submitted in order, so each index maps to itself
+    array = (unsigned int*)(sq_ptr + params.sq_off.array);
+    for (i = 0; i < params.sq_entries; i++) {
+        array[i] = i;
+    }
+
+    // Receive buffers are registered as a ring the kernel picks from
+    ring->buf_ring_size = RING_BUFFERS*sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->buffers = malloc(RING_BUFFERS*RING_BUFFER_SIZE);
+    if (ring->buf_ring == MAP_FAILED || !ring->buffers) {
+        ring->buf_ring = NULL;
+        free_ring(ring);
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)ring->buf_ring;
+    reg.ring_entries = RING_BUFFERS;
+    reg.bgid = RING_GROUP;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING,
+        &reg, 1) < 0) {
+        free_ring(ring);
+        return -1;
+    }
+
+    for (i = 0; i < RING_BUFFERS; i++) {
+        ring->buf_ring->bufs[i].addr =
+            (unsigned long)(ring->buffers + i*RING_BUFFER_SIZE);
+        ring->buf_ring->bufs[i].len = RING_BUFFER_SIZE;
+        ring->buf_ring->bufs[i].bid = i;
+    }
+    atomic_thread_fence(memory_order_release);
+    ring->buf_ring->tail = RING_BUFFERS;
+
+    return 0;
+}
+
+// Gets a free submission entry, flushing the queue to the kernel if full
+struct io_uring_sqe *get_sqe(Ring *ring) {
+    struct io_uring_sqe *sqe = NULL;
+    unsigned int tail = *ring->sq_tail;
+
+    while (tail - atomic_load_explicit((_Atomic unsigned int*)ring->sq_head,
+        memory_order_acquire) == ring->sq_entries) {
+        submit_ring(ring, 0);
+    }
+
+    sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+
+    // The kernel only reads the entry on the next submit, so it is filled
+    // in after the tail has moved past it
+    atomic_store_explicit((_Atomic unsigned int*)ring->sq_tail, tail + 1,
+        memory_order_release);
+    ring->sq_pending++;
+
+    return sqe;
+}
+
+// Submits queued entries and waits up to timeout ms for a completion
+int submit_ring(Ring *ring, int timeout) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned int flags = 0, wait = 0;
+    int status;
+
+    if (timeout > 0) {
+        ts.tv_sec = timeout / MS_PER_SEC;
+        ts.tv_nsec = (timeout % MS_PER_SEC)*NS_PER_MS;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (unsigned long)&ts;
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        wait = 1;
+    }
+
+    status = syscall(__NR_io_uring_enter, ring->fd, ring->sq_pending, wait,
+        flags, timeout > 0 ? &arg : NULL, timeout > 0 ? sizeof(arg) : 0);
+    if (status < 0) {
+        // Running out of time or being interrupted only ends the wait
+        if (errno != ETIME && errno != EINTR && errno != EBUSY) {
+            perror("io_uring_enter");
+        }
+        return -1;
+    }
+    ring->sq_pending -= status;
+
+    return 0;
+}
+
+// Gets the next completion, or NULL if there is none
+struct io_uring_cqe *peek_cqe(Ring *ring) {
+    unsigned int head = *ring->cq_head;
+
+    if (head == atomic_load_explicit((_Atomic unsigned int*)ring->cq_tail,
+        memory_order_acquire)) {
+        return NULL;
+    }
+
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+// Marks the completion returned by peek_cqe as handled
+void seen_cqe(Ring *ring) {
+    atomic_store_explicit((_Atomic unsigned int*)ring->cq_head,
+        *ring->cq_head + 1, memory_order_release);
+}
+
+// Gets the receive buffer the kernel picked for a completion
+unsigned char *get_buffer(Ring *ring, struct io_uring_cqe *cqe) {
+    return ring->buffers +
+        (cqe->flags >> IORING_CQE_BUFFER_SHIFT)*RING_BUFFER_SIZE;
+}
+
+// Hands a receive buffer back to the kernel
+void recycle_buffer(Ring *ring, struct io_uring_cqe *cqe) {
+    unsigned short tail = ring->buf_ring->tail;
+    struct io_uring_buf *buf =
+        &ring->buf_ring->bufs[tail & (RING_BUFFERS - 1)];
+    int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+    buf->addr = (unsigned long)(ring->buffers + bid*RING_BUFFER_SIZE);
+    buf->len = RING_BUFFER_SIZE;
+    buf->bid = bid;
+
+    atomic_thread_fence(memory_order_release);
+    ring->buf_ring->tail = tail + 1;
+}
+
+// Accepts connections on the listener until cancelled
+void queue_accept(Ring *ring, int sockfd, void *data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sockfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = (unsigned long)data;
+}
+
+// Polls a descriptor for readability until cancelled
+void queue_poll(Ring *ring, int fd, void *data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = (unsigned long)data;
+}
+
+// Receives up to len bytes into a buffer picked by the kernel
+void queue_recv(Ring *ring, int sockfd, int len, void *data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sockfd;
+    sqe->len = len < RING_BUFFER_SIZE ? len : RING_BUFFER_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RING_GROUP;
+    sqe->user_data = (unsigned long)data;
+}
+
+// Sends len bytes of the buffer
+void queue_send(Ring *ring, int sockfd, unsigned char *buffer, int len,
+    void *data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = sockfd;
+    sqe->addr = (unsigned long)buffer;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (unsigned long)data;
+}
+
+// Closes the descriptor without waiting for it
+void queue_close(Ring *ring, int fd) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = 0;
+}
+
+// Frees the memory mapped for the ring and closes it
+void free_ring(Ring *ring) {
+    if (ring->buf_ring) {
+        munmap(ring->buf_ring, ring->buf_ring_size);
+    }
+    free(ring->buffers);
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sq_entries*sizeof(struct io_uring_sqe));
+    }
+    if (ring->cq_map) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    if (ring->sq_map) {
+        munmap(ring->sq_map, ring->sq_map_size);
+    }
+    close(ring->fd);
+}
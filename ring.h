@@ -0,0 +1,91 @@
+#ifndef RING
+#define RING
+
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#define RING_ENTRIES 256        // Submissions queued before a flush
+#define RING_BUFFERS 256        // Receive buffers handed to the kernel
+#define RING_BUFFER_SIZE 4096   // Size of each receive buffer
+#define RING_GROUP 0            // Group the receive buffers are picked from
+
+// io_uring instance of one event loop, driven by raw system calls
+typedef struct {
+    int fd;
+
+    // Submission queue, shared with the kernel
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned int sq_pending;
+    void *sq_map;
+    size_t sq_map_size;
+
+    // Completion queue, shared with the kernel
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+    void *cq_map;
+    size_t cq_map_size;
+
+    // Buffers the kernel fills on receives, returned once copied out
+    struct io_uring_buf_ring *buf_ring;
+    unsigned char *buffers;
+    size_t buf_ring_size;
+} Ring;
+
+// Sets up the ring and its receive buffers, returns -1 if io_uring is not
+// available
+int setup_ring(Ring *ring);
+
+// Gets a free submission entry, flushing the queue to the kernel if full
+struct io_uring_sqe *get_sqe(Ring *ring);
+
+// Submits queued entries and waits up to timeout ms for a completion
+int submit_ring(Ring *ring, int timeout);
+
+// Gets the next completion, or NULL if there is none
+struct io_uring_cqe *peek_cqe(Ring *ring);
+
+// Marks the completion returned by peek_cqe as handled
+void seen_cqe(Ring *ring);
+
+// Gets the receive buffer the kernel picked for a completion
+unsigned char *get_buffer(Ring *ring, struct io_uring_cqe *cqe);
+
+// Hands a receive buffer back to the kernel
+void recycle_buffer(Ring *ring, struct io_uring_cqe *cqe);
+
+// Accepts connections on the listener until cancelled
+void queue_accept(Ring *ring, int sockfd, void *data);
+
+// Polls a descriptor for readability until cancelled
+void queue_poll(Ring *ring, int fd, void *data);
+
+// Receives up to len bytes into a buffer picked by the kernel
+void queue_recv(Ring *ring, int sockfd, int len, void *data);
+
+// Sends len bytes of the buffer
+void queue_send(Ring *ring, int sockfd, unsigned char *buffer, int len,
+    void *data);
+
+// Closes the descriptor without waiting for it
+void queue_close(Ring *ring, int fd);
+
+// Frees the memory mapped for the ring and closes it
+void free_ring(Ring *ring);
+
+#endif
@@ -1,14 +1,33 @@
 #include "server.h"
 
 #define ON 1                // Keeps server on
-#define IPv6_PORT 8053      // Port to accept TCP queries from
-#define AAAA 28             // IANA assigned value for AAAA record type
-#define TCP_HEADER_SIZE 2   // Size of TCP header
+#define IPv6_PORT 8053      // Port to accept TCP and UDP queries from
+#define UDP_MIN_SIZE 512    // Largest UDP response allowed without EDNS
+#define QUERY_MASK 0xf8     // QR and opcode bits of the first flags byte
+#define UDP_BUFFER_SIZE (1 << 22)   // Receive buffer of the UDP socket
+#define MAX_WORKERS 32      // Most event loop threads, one per CPU
+#define MAX_EVENTS 64       // Maximum events handled per epoll_wait
+#define SWEEP_INTERVAL 1000 // Longest wait in ms between cache expiry sweeps
+#define TICK_MS 10          // Resolution in ms of the query deadlines
+#define STALE_TIMEOUT 1800  // Wait in ms before serving a stale answer
+#define UPSTREAM_TIMEOUT 5000   // Wait in ms before a query fails
+#define MAX_WAITING 1024    // Queries an event loop lets wait on upstreams
+#define IDLE_TIMEOUT 10000  // Wait in ms before an idle client is let go
+#define MAX_PIPELINED 64    // Queries a client connection may have waiting
+#define WRITE_BATCH 64      // Most replies written per system call
+#define METRICS_TIMEOUT 1   // Seconds a stats client may take to ask
+#define REQUEST_SIZE 4096   // Bytes of a stats request read, the rest ignored
+#define ACCEPT_BACKOFF 100    // Wait in ms after an accept fails
+#define FIRST_LIMIT 7       // Stats bucket limits, as powers of two ns from
+#define LAST_LIMIT 36       // 128 ns to about a minute
 
 #define NONBLOCKING
 
-// Creates a socket for receiving queries
-int create_server_socket() {
+static int worker_count;    // Event loops started by run_server
+static int metrics_sockfd;  // Socket the stats are served on, if any
+
+// Creates a socket of the given type for receiving queries
+int create_server_socket(int type) {
     int sockfd;
     struct sockaddr_in6 addr;
 
@@ -18,7 +37,7 @@ int create_server_socket() {
 	addr.sin6_port = htons(IPv6_PORT);
 
     // Opens a socket
-    if ((sockfd = socket(AF_INET6, SOCK_STREAM, 0)) < 0) {
+    if ((sockfd = socket(AF_INET6, type, 0)) < 0) {
         perror("socket");
         exit(EXIT_FAILURE);
     }
@@ -31,6 +50,14 @@ int create_server_socket() {
 		exit(EXIT_FAILURE);
 	}
 
+    // Each event loop binds its own socket, the kernel spreads the
+    // connections and datagrams between them
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &enable,
+        sizeof(int)) < 0) {
+        perror("setsockopt");
+        exit(EXIT_FAILURE);
+    }
+
     // Binds address to socket
     if (bind(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
         perror("bind");
@@ -40,243 +67,1961 @@ int create_server_socket() {
     return sockfd;
 }
 
-// Creates a socket for forwarding queries and receiving answers
-int create_connection_socket(const char *ip, const int port) {
-    int sockfd;
+// Creates the socket the stats are served on, reachable only locally
+int create_metrics_socket(int port) {
     struct sockaddr_in addr;
+    int sockfd, enable = 1;
 
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = inet_addr(ip);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
     addr.sin_port = htons(port);
 
-    // Opens a socket to server
     if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         perror("socket");
         exit(EXIT_FAILURE);
     }
 
-    // Connects to server at address using specified socket
-    if (connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        perror("connect");
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable,
+        sizeof(int)) < 0) {
+        perror("setsockopt");
         exit(EXIT_FAILURE);
     }
 
-    return sockfd;
-}
+    if (bind(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        exit(EXIT_FAILURE);
+    }
 
-// Runs miniature DNS server
-void run_server(const char *ip, const int port) {
-    int sockfd, clt_sockfd, svr_sockfd;
-    Properties *prop = malloc(sizeof(*prop));
-    Cache *cache = create_cache();
-    sockfd = create_server_socket();
-    pthread_t thread;
-
-    // Listens and queues incoming queries
     if (listen(sockfd, SOMAXCONN) < 0) {
         perror("listen");
         exit(EXIT_FAILURE);
     }
 
-    while (ON) {
-        if ((clt_sockfd = accept(sockfd, NULL, NULL)) < 0) {
-            perror("accept");
+    return sockfd;
+}
+
+// Runs miniature DNS server
+void run_server(Address *upstreams, int upstream_count,
+    unsigned int capacity, time_t grace, int use_ring, int metrics_port) {
+    int i, j, k, cpus, udp_buffer_size = UDP_BUFFER_SIZE;
+    Properties *prop = NULL;
+    Cache *cache = create_cache(capacity, grace);
+    Flight_Table *flights = create_flights();
+    Refresher *refresher = NULL;
+    pthread_t threads[MAX_WORKERS], stats_thread, metrics_thread;
+    cpu_set_t cpu_set;
+    sigset_t signals;
+
+    // One event loop per CPU
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    worker_count = cpus < 1 ? 1 : cpus > MAX_WORKERS ? MAX_WORKERS : cpus;
+    prop = malloc(worker_count*sizeof(*prop));
+    assert(prop);
+
+    // Replies to clients that hung up must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // Only the stats thread takes SIGUSR1, so every thread started from
+    // here on blocks it
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    // Lines are written by their own thread, off the request path
+    start_logger();
+
+    // Hot answers are fetched again by their own thread before expiring
+    refresher = start_refresher(cache, upstreams, upstream_count);
+    cache->refresh = request_refresh;
+    cache->refresh_arg = refresher;
+
+    // Each event loop accepts and reads on its own sockets, pinned to its
+    // own CPU
+    for (i = 0; i < worker_count; i++) {
+        memset(&prop[i], 0, sizeof(prop[i]));
+        prop[i].worker = i;
+        prop[i].cpu = cpus > 0 ? i % cpus : 0;
+
+        if ((prop[i].epfd = epoll_create1(0)) < 0) {
+            perror("epoll_create1");
+            exit(EXIT_FAILURE);
+        }
+
+        prop[i].listener.type = LISTENER;
+        prop[i].listener.sockfd = create_server_socket(SOCK_STREAM);
+        prop[i].listener.session = NULL;
+        set_nonblocking(prop[i].listener.sockfd);
+        prop[i].accept_retry = 0;
+
+        // Listens and queues incoming queries
+        if (listen(prop[i].listener.sockfd, SOMAXCONN) < 0) {
+            perror("listen");
+            exit(EXIT_FAILURE);
+        }
+
+        prop[i].udp.type = DATAGRAM;
+        prop[i].udp.sockfd = create_server_socket(SOCK_DGRAM);
+        prop[i].udp.session = NULL;
+        set_nonblocking(prop[i].udp.sockfd);
+
+        // Leaves room for bursts of datagrams while misses go upstream
+        if (setsockopt(prop[i].udp.sockfd, SOL_SOCKET, SO_RCVBUF,
+            &udp_buffer_size, sizeof(int)) < 0) {
+            perror("setsockopt");
+        }
+
+        prop[i].out = malloc(UDP_BATCH*sizeof(Datagram));
+        prop[i].out_count = 0;
+        prop[i].cache = cache;
+        prop[i].flights = flights;
+        prop[i].closed = NULL;
+        prop[i].closed_sessions = NULL;
+        assert(prop[i].out);
+        init_wheel(&prop[i].deadlines, get_tick());
+        init_wheel(&prop[i].idle, get_tick());
+
+        // Upstream connections are opened on their first query and kept
+        prop[i].upstream_count = upstream_count;
+        for (k = 0; k < upstream_count; k++) {
+            init_latency(&prop[i].latency[k]);
+            for (j = 0; j < UPSTREAM_CONNS; j++) {
+                prop[i].upstream_eps[k][j].type = UPSTREAM;
+                prop[i].upstream_eps[k][j].sockfd = -1;
+                prop[i].upstream_eps[k][j].session = NULL;
+                prop[i].upstreams[k][j] = create_upstream(upstreams[k].ip,
+                    upstreams[k].port, prop[i].epfd,
+                    &prop[i].upstream_eps[k][j], process_response, &prop[i]);
+                prop[i].upstream_eps[k][j].upstream =
+                    prop[i].upstreams[k][j];
+            }
+        }
+
+        // Replies for this loop's queries answered by other loops
+        prop[i].inbox_ep.type = INBOX;
+        prop[i].inbox_ep.session = NULL;
+        if ((prop[i].inbox_ep.sockfd = eventfd(0, EFD_NONBLOCK)) < 0) {
+            perror("eventfd");
             exit(EXIT_FAILURE);
         }
+        pthread_mutex_init(&prop[i].inbox_lock, NULL);
+        prop[i].inbox = NULL;
+        watch_endpoint(&prop[i], &prop[i].inbox_ep, EPOLLIN | EPOLLET);
+
+        watch_endpoint(&prop[i], &prop[i].udp, EPOLLIN | EPOLLET);
+
+        // With the ring, connections are accepted by one multishot request
+        // and the remaining sockets are reached through the epoll descriptor
+        prop[i].use_ring = use_ring && setup_ring(&prop[i].ring) == 0;
+        if (use_ring && !prop[i].use_ring) {
+            fprintf(stderr, "io_uring unavailable, using epoll\n");
+        }
+        if (prop[i].use_ring) {
+            prop[i].poll_ep.type = POLLER;
+            prop[i].poll_ep.sockfd = prop[i].epfd;
+            prop[i].poll_ep.session = NULL;
+            queue_poll(&prop[i].ring, prop[i].epfd, &prop[i].poll_ep);
+            queue_accept(&prop[i].ring, prop[i].listener.sockfd,
+                &prop[i].listener);
+        } else {
+            watch_endpoint(&prop[i], &prop[i].listener, EPOLLIN | EPOLLET);
+        }
+        pthread_create(&threads[i], NULL, run_event_loop, &prop[i]);
+
+        // Runs unpinned if the CPU cannot be had
+        CPU_ZERO(&cpu_set);
+        CPU_SET(prop[i].cpu, &cpu_set);
+        if (pthread_setaffinity_np(threads[i], sizeof(cpu_set),
+            &cpu_set) != 0) {
+            prop[i].cpu = -1;
+        }
+    }
 
-        svr_sockfd = create_connection_socket(ip, port);
+    pthread_create(&stats_thread, NULL, run_stats, prop);
+    pthread_detach(stats_thread);
 
-        prop->clt_sockfd = clt_sockfd;
-        prop->svr_sockfd = svr_sockfd;
-        prop->cache = cache;
+    // Stats are scraped from their own thread, only if asked for
+    if (metrics_port > 0) {
+        metrics_sockfd = create_metrics_socket(metrics_port);
+        pthread_create(&metrics_thread, NULL, run_metrics, prop);
+        pthread_detach(metrics_thread);
+    }
 
-        pthread_create(&thread, NULL, process_message, prop);
+    for (i = 0; i < worker_count; i++) {
+        pthread_join(threads[i], NULL);
+        close(prop[i].listener.sockfd);
+        close(prop[i].udp.sockfd);
+        free(prop[i].out);
+        close(prop[i].inbox_ep.sockfd);
+        pthread_mutex_destroy(&prop[i].inbox_lock);
+        if (prop[i].use_ring) {
+            free_ring(&prop[i].ring);
+        }
+        for (k = 0; k < upstream_count; k++) {
+            for (j = 0; j < UPSTREAM_CONNS; j++) {
+                free_upstream(prop[i].upstreams[k][j]);
+            }
+        }
     }
 
-    close(sockfd);
     free_cache(cache);
+    free_flights(flights);
     free(prop);
 }
 
-// Handles message processing to/from client and server
-void *process_message(void *param) {
+// Waits for and dispatches socket events
+void *run_event_loop(void *param) {
     Properties *prop = (Properties*)param;
-    int clt_sockfd = prop->clt_sockfd, svr_sockfd = prop->svr_sockfd;
-    Cache *cache = prop->cache;
-    Message *msg = NULL, *match = NULL;
+    struct epoll_event events[MAX_EVENTS];
+    Connection *conn = NULL;
+    Session *session = NULL;
+    int count;
 
-    msg = receive_msg(clt_sockfd);
-    log_request(msg);
+    while (ON) {
+        if (prop->use_ring) {
+            // Submits the requests queued by the last batch in the same
+            // system call that waits for the next
+            submit_ring(&prop->ring, get_timeout(prop));
+            reap_completions(prop);
+        } else if ((count = epoll_wait(prop->epfd, events, MAX_EVENTS,
+            get_timeout(prop))) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        } else {
+            handle_events(prop, events, count);
+        }
 
-    match = lookup(cache, msg);
+        // Queries the upstream is slow to answer are answered without it
+        expire_deadlines(prop);
+        expire_sessions(prop);
+        retry_accept(prop);
 
-    // Checks if rcode = 4 or if answer not found in cache
-    if (!check_rcode(msg) && !match) {
+        // Answers every datagram completed during this batch of events
+        flush_datagrams(prop);
 
-        send_msg(svr_sockfd, msg);
-        msg = receive_msg(svr_sockfd);
+        // Whichever loop gets here first in a second frees expired answers
+        expire_cache(prop->cache);
 
-        // Caches message if answer exists
-        if (msg->ans_count > 0) {
-            cache_item(cache, msg);
+        // Frees connections only once no pending event can refer to them
+        while (prop->closed) {
+            conn = prop->closed;
+            prop->closed = conn->next_closed;
+            free(conn);
+        }
+        while (prop->closed_sessions) {
+            session = prop->closed_sessions;
+            prop->closed_sessions = session->next_closed;
+            free(session);
         }
+    }
+
+    return NULL;
+}
+
+// Dispatches the events returned by epoll
+void handle_events(Properties *prop, struct epoll_event *events, int count) {
+    Endpoint *ep = NULL;
+    Session *session = NULL;
+    int i;
 
-        // Checks if answer exists and first answer type is AAAA
-        if (msg->ans_count > 0 && msg->ans_list[0]->type == htons(AAAA)) {
-            log_result(msg);
+    for (i = 0; i < count; i++) {
+        ep = (Endpoint*)events[i].data.ptr;
+
+        if (ep->type == LISTENER) {
+            accept_clients(prop);
+            continue;
+        } else if (ep->type == DATAGRAM) {
+            receive_datagrams(prop);
+            continue;
+        } else if (ep->type == UPSTREAM) {
+            handle_upstream(ep->upstream, events[i].events);
+            continue;
+        } else if (ep->type == INBOX) {
+            receive_replies(prop);
+            continue;
         }
-    } else if (match) {
-        match->hdr->id = msg->hdr->id;
-        msg = match;
-        log_result(msg);
-    } else {
-        log_unimplemented();
+
+        session = ep->session;
+
+        // Connection may have been closed by an earlier event
+        if (session->stage == CLOSED) {
+            continue;
+        }
+
+        process_session(prop, session);
     }
+}
 
-    send_msg(clt_sockfd, msg);
+// Handles every completion posted to the ring
+void reap_completions(Properties *prop) {
+    struct epoll_event events[MAX_EVENTS];
+    struct io_uring_cqe *cqe = NULL;
+    Endpoint *ep = NULL;
+    Session *session = NULL;
+    int count;
 
-    close(svr_sockfd);
-    close(clt_sockfd);
+    while ((cqe = peek_cqe(&prop->ring))) {
+        ep = (Endpoint*)(unsigned long)cqe->user_data;
 
-    return NULL;
+        if (!ep) {
+            // Closes report nothing worth handling
+        } else if (ep->type == POLLER) {
+            // Sockets still watched by epoll are ready
+            do {
+                count = epoll_wait(prop->epfd, events, MAX_EVENTS, 0);
+                if (count > 0) {
+                    handle_events(prop, events, count);
+                }
+            } while (count == MAX_EVENTS);
+
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                queue_poll(&prop->ring, prop->epfd, &prop->poll_ep);
+            }
+        } else if (ep->type == LISTENER) {
+            if (cqe->res >= 0) {
+                session = create_client(prop, cqe->res);
+                session->ring_io = 1;
+                process_session(prop, session);
+            } else if (cqe->res != -EINTR && cqe->res != -ECONNABORTED &&
+                cqe->res != -EAGAIN) {
+                errno = -cqe->res;
+                defer_accept(prop);
+            }
+
+            if (!(cqe->flags & IORING_CQE_F_MORE) && !prop->accept_retry) {
+                queue_accept(&prop->ring, prop->listener.sockfd,
+                    &prop->listener);
+            }
+        } else if (ep->type == SENDER) {
+            complete_send(prop, ep->session, cqe);
+        } else {
+            complete_receive(prop, ep->session, cqe);
+        }
+
+        seen_cqe(&prop->ring);
+    }
 }
 
-// Reads query/response received in the socket
-Message *receive_msg(const int sockfd) {
-    unsigned char *size_buffer = read_from_sock(sockfd, TCP_HEADER_SIZE);
-    unsigned char *msg_buffer;
-    Message *msg = NULL;
-    int size;
+// Handles a finished receive on a client connection driven by the ring
+void complete_receive(Properties *prop, Session *session,
+    struct io_uring_cqe *cqe) {
+    int len = cqe->res;
 
-    memcpy(&size, size_buffer, sizeof(int));
-    size = (int)ntohs((int)size);
+    session->receiving = 0;
 
-    msg_buffer = read_from_sock(sockfd, size);
-    msg = create_msg(msg_buffer, size);
+    // Copies the bytes out so the buffer can go straight back
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        if (len > 0 && session->stage != CLOSED) {
+            memcpy(session->in_buffer, get_buffer(&prop->ring, cqe), len);
+            session->in_off = 0;
+            session->in_len = len;
+            session->active = get_tick();
+        }
+        recycle_buffer(&prop->ring, cqe);
+    }
 
-    memcpy(&msg->tcp_hdr, size_buffer, TCP_HEADER_SIZE);
+    if (session->stage == CLOSED) {
+        release_session(prop, session);
+        return;
+    }
 
-    // If not response (MSB == 1) and question type is not AAAA
-    if (!((ntohs(msg->hdr->flgs) >> 0x0f) & 1U) &&
-    !(msg->qn_list[0]->qtype == htons(AAAA))) {
-        set_rcode(msg);
+    // Receives are retried once the kernel has been given buffers back
+    if (len == 0) {
+        session->finished = 1;
+    } else if (len < 0 && len != -ENOBUFS) {
+        close_session(prop, session);
+        return;
+    }
+
+    process_session(prop, session);
+}
+
+// Handles a finished send on a client connection driven by the ring
+void complete_send(Properties *prop, Session *session,
+    struct io_uring_cqe *cqe) {
+    int len = cqe->res;
+
+    session->sending = 0;
+
+    if (session->stage == CLOSED) {
+        release_session(prop, session);
+        return;
+    } else if (len <= 0) {
+        close_session(prop, session);
+        return;
     }
 
-    free(size_buffer);
-    free(msg_buffer);
+    session->bytes_written += len;
+    if (session->bytes_written == session->out_head->len) {
+        finish_reply(prop, session);
+    }
 
-    return msg;
+    if (send_replies(prop, session)) {
+        process_session(prop, session);
+    }
 }
 
-// Transforms message into response with rcode 4
-void set_rcode(Message *msg) {
-    // Set qr to 1 (MSB = 1)
-    msg->hdr->flgs = htons(ntohs(msg->hdr->flgs) | (1U << 0x0f));
-    // Set 4 LSB to Rcode 4 (0100 in binary)
-    msg->hdr->flgs = htons(ntohs(msg->hdr->flgs) & ~(1U << 0x03));
-    msg->hdr->flgs = htons(ntohs(msg->hdr->flgs) | (1U << 0x02));
-    msg->hdr->flgs = htons(ntohs(msg->hdr->flgs) & ~(1U << 0x01));
-    msg->hdr->flgs = htons(ntohs(msg->hdr->flgs) & ~1U);
-    // Set rd to 0
-    msg->hdr->flgs = htons(ntohs(msg->hdr->flgs) & ~(1U << 0x08));
+// Writes the counters of every event loop to stderr whenever SIGUSR1
+// arrives
+void *run_stats(void *param) {
+    Properties *prop = (Properties*)param;
+    Worker_Stats *stats = NULL;
+    sigset_t signals;
+    int i, sig;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+
+    while (sigwait(&signals, &sig) == 0) {
+        for (i = 0; i < worker_count; i++) {
+            stats = &prop[i].stats;
+            fprintf(stderr, "worker %d cpu %d: %lu accepted, %lu datagrams, "
+                "%lu queries, %lu hits, %lu misses, %lu unimplemented, "
+                "%lu forwarded, %lu hedged, %lu upstream errors, "
+                "%lu failed, %lu shed\n",
+                prop[i].worker, prop[i].cpu,
+                atomic_load_explicit(&stats->accepted, memory_order_relaxed),
+                atomic_load_explicit(&stats->datagrams, memory_order_relaxed),
+                atomic_load_explicit(&stats->queries, memory_order_relaxed),
+                atomic_load_explicit(&stats->hits, memory_order_relaxed),
+                atomic_load_explicit(&stats->misses, memory_order_relaxed),
+                atomic_load_explicit(&stats->notimp, memory_order_relaxed),
+                atomic_load_explicit(&stats->forwarded, memory_order_relaxed),
+                atomic_load_explicit(&stats->hedged, memory_order_relaxed),
+                atomic_load_explicit(&stats->upstream_errors,
+                    memory_order_relaxed),
+                atomic_load_explicit(&stats->failed, memory_order_relaxed),
+                atomic_load_explicit(&stats->shed, memory_order_relaxed));
+        }
+    }
+
+    return NULL;
+}
+
+// Adds one to a counter only its own event loop writes
+void count_stat(atomic_ulong *stat) {
+    add_relaxed(stat, 1);
+}
+
+// Records the time since start against the stage, returns the current time
+long time_stage(Properties *prop, Latency_Stage stage, long start) {
+    long now = get_nanos();
+
+    record_duration(&prop->stats.stages[stage], now - start);
+
+    return now;
 }
 
-// Sends query/response through the socket
-void send_msg(const int sockfd, Message *msg) {
+// Serves the counters and stage latencies of every event loop, summed, to
+// each connection made to the stats socket
+void *run_metrics(void *param) {
+    Properties *prop = (Properties*)param;
+    struct timeval timeout;
+    char request[REQUEST_SIZE], *body = NULL;
+    size_t len;
+    int sockfd, bytes_written;
+    FILE *out = NULL;
+
+    timeout.tv_sec = METRICS_TIMEOUT;
+    timeout.tv_usec = 0;
+
+    while (ON) {
+        // A failed accept, such as running out of descriptors, is retried
+        // after a pause rather than at once, so it does not spin a CPU
+        if ((sockfd = accept(metrics_sockfd, NULL, NULL)) < 0) {
+            if (errno != EINTR) {
+                perror("accept");
+                usleep(ACCEPT_BACKOFF*1000);
+            }
+            continue;
+        }
 
-    write(sockfd, &msg->tcp_hdr, sizeof(msg->tcp_hdr));
+        // Any request gets the stats, so it is read only to be polite to
+        // HTTP clients
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+            sizeof(timeout));
+        setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+            sizeof(timeout));
+        if (read(sockfd, request, sizeof(request)) < 0 && errno != EAGAIN) {
+            close(sockfd);
+            continue;
+        }
 
-    send_hdr(sockfd, msg->hdr);
-    send_qn(sockfd, msg->qn_list, msg->qn_count);
-    send_ans(sockfd, msg->ans_list, msg->ans_count);
+        out = open_memstream(&body, &len);
+        assert(out);
+        write_metrics(prop, out);
+        fclose(out);
 
-    write(sockfd, msg->add, msg->add_len);
+        dprintf(sockfd, "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %zu\r\n\r\n", len);
+        bytes_written = 0;
+        write_to_sock(sockfd, (unsigned char*)body, len, &bytes_written);
 
-    if (check_rcode(msg)) {
-        free_msg(msg);
+        free(body);
+        close(sockfd);
     }
+
+    return NULL;
 }
 
-// Sends header through the socket
-void send_hdr(const int sockfd, Header *hdr) {
-    write(sockfd, &hdr->id, sizeof(hdr->id));
-    write(sockfd, &hdr->flgs, sizeof(hdr->flgs));
-    write(sockfd, &hdr->qns, sizeof(hdr->qns));
-    write(sockfd, &hdr->ans_rr, sizeof(hdr->ans_rr));
-    write(sockfd, &hdr->athr_rr, sizeof(hdr->athr_rr));
-    write(sockfd, &hdr->add_rr, sizeof(hdr->add_rr));
+// Writes the counters and stage latencies of every event loop, summed, in
+// the Prometheus text format
+void write_metrics(Properties *prop, FILE *out) {
+    static const struct {
+        const char *name;
+        const char *help;
+        size_t offset;
+    } counters[] = {
+        {"dns_connections_accepted_total", "TCP connections accepted",
+            offsetof(Worker_Stats, accepted)},
+        {"dns_datagrams_received_total", "UDP queries received",
+            offsetof(Worker_Stats, datagrams)},
+        {"dns_queries_total", "Queries parsed",
+            offsetof(Worker_Stats, queries)},
+        {"dns_cache_hits_total", "Queries answered from the cache",
+            offsetof(Worker_Stats, hits)},
+        {"dns_cache_misses_total", "Queries not found in the cache",
+            offsetof(Worker_Stats, misses)},
+        {"dns_notimp_responses_total", "Queries answered with rcode 4",
+            offsetof(Worker_Stats, notimp)},
+        {"dns_upstream_queries_total", "Queries forwarded upstream",
+            offsetof(Worker_Stats, forwarded)},
+        {"dns_upstream_hedges_total", "Queries also sent to a second upstream",
+            offsetof(Worker_Stats, hedged)},
+        {"dns_upstream_errors_total", "Upstream queries that failed",
+            offsetof(Worker_Stats, upstream_errors)},
+        {"dns_servfail_responses_total", "Queries answered with SERVFAIL",
+            offsetof(Worker_Stats, failed)},
+        {"dns_shed_responses_total", "Queries refused under overload",
+            offsetof(Worker_Stats, shed)}
+    };
+    static const double quantiles[] = {0.5, 0.99, 0.999};
+    Histogram total;
+    const char *stage = NULL;
+    unsigned long seen;
+    int i, j, k;
+
+    for (i = 0; i < sizeof(counters)/sizeof(counters[0]); i++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n",
+            counters[i].name, counters[i].help, counters[i].name,
+            counters[i].name, sum_stat(prop, counters[i].offset));
+    }
+    fprintf(out, "# HELP dns_cache_evictions_total Answers evicted to make "
+        "room\n# TYPE dns_cache_evictions_total counter\n"
+        "dns_cache_evictions_total %lu\n", atomic_load_explicit(
+        &prop->cache->evictions, memory_order_relaxed));
+
+    fprintf(out, "# HELP dns_stage_duration_seconds Time spent in each "
+        "stage of a query\n# TYPE dns_stage_duration_seconds histogram\n");
+    for (i = 0; i < STAGE_COUNT; i++) {
+        stage = get_stage_name(i);
+        memset(&total, 0, sizeof(total));
+        for (j = 0; j < worker_count; j++) {
+            merge_histogram(&total, &prop[j].stats.stages[i]);
+        }
+
+        // Coarser buckets than the histogram's own, one per power of two
+        seen = 0;
+        k = 0;
+        for (j = FIRST_LIMIT; j <= LAST_LIMIT; j++) {
+            while (k < HISTOGRAM_BUCKETS && get_bucket_limit(k) <= 1L << j) {
+                seen += total.buckets[k++];
+            }
+            fprintf(out, "dns_stage_duration_seconds_bucket{stage=\"%s\","
+                "le=\"%g\"} %lu\n", stage, (double)(1L << j) / 1e9, seen);
+        }
+        fprintf(out, "dns_stage_duration_seconds_bucket{stage=\"%s\","
+            "le=\"+Inf\"} %lu\n", stage, (unsigned long)total.count);
+        fprintf(out, "dns_stage_duration_seconds_sum{stage=\"%s\"} %g\n",
+            stage, (double)total.sum / 1e9);
+        fprintf(out, "dns_stage_duration_seconds_count{stage=\"%s\"} %lu\n",
+            stage, (unsigned long)total.count);
+    }
+
+    // Quantiles from the full resolution of the histograms
+    fprintf(out, "# HELP dns_stage_duration_quantile_seconds Time within "
+        "which the given share of each stage finished\n"
+        "# TYPE dns_stage_duration_quantile_seconds gauge\n");
+    for (i = 0; i < STAGE_COUNT; i++) {
+        memset(&total, 0, sizeof(total));
+        for (j = 0; j < worker_count; j++) {
+            merge_histogram(&total, &prop[j].stats.stages[i]);
+        }
+        for (j = 0; j < sizeof(quantiles)/sizeof(quantiles[0]); j++) {
+            fprintf(out, "dns_stage_duration_quantile_seconds{stage=\"%s\","
+                "quantile=\"%g\"} %g\n", get_stage_name(i), quantiles[j],
+                (double)get_quantile(&total, quantiles[j]) / 1e9);
+        }
+    }
 }
 
-// Sends questions through the socket
-void send_qn(const int sockfd, Question **qn_list, int qn_count) {
+// Sums a counter over every event loop, given its offset in Worker_Stats
+unsigned long sum_stat(Properties *prop, size_t offset) {
+    unsigned long total = 0;
     int i;
 
-    for (i = 0; i < qn_count; i++) {
-        send_qname(sockfd, qn_list[i]);
-        write(sockfd, &qn_list[i]->qtype, sizeof(qn_list[i]->qtype));
-        write(sockfd, &qn_list[i]->qclass, sizeof(qn_list[i]->qclass));
+    for (i = 0; i < worker_count; i++) {
+        total += atomic_load_explicit((atomic_ulong*)((char*)&prop[i].stats +
+            offset), memory_order_relaxed);
     }
+
+    return total;
 }
 
-// Sends question name through the socket
-void send_qname(const int sockfd, Question *qn) {
-    int i;
+// Accepts all pending client connections
+void accept_clients(Properties *prop) {
+    int clt_sockfd;
+    Session *session = NULL;
 
-    for (i = 0; i < qn->name_count; i++) {
-        write(sockfd, &qn->name[i]->len, sizeof(qn->name[i]->len));
+    while (ON) {
+        clt_sockfd = accept4(prop->listener.sockfd, NULL, NULL,
+            SOCK_NONBLOCK);
 
-        // Exclude the zero byte at the end of qname
-        if (i < qn->name_count - 1) {
-            write(sockfd, qn->name[i]->label, qn->name[i]->label_len);
+        if (clt_sockfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                defer_accept(prop);
+            }
+            return;
         }
+
+        session = create_client(prop, clt_sockfd);
+
+        // Also woken when replies that did not fit can be written further
+        watch_endpoint(prop, &session->clt, EPOLLIN | EPOLLOUT | EPOLLET);
     }
 }
 
-// Sends answers through the socket
-void send_ans(const int sockfd, Answer **ans_list, int ans_count) {
-    int i;
+// Reports a failed accept, such as running out of descriptors, and waits a
+// while before accepting again. The listener is edge triggered, so the
+// connections already waiting would not raise another event
+void defer_accept(Properties *prop) {
+    perror("accept");
+    prop->accept_retry = get_tick() + ACCEPT_BACKOFF / TICK_MS;
+}
+
+// Accepts again once the wait after a failed accept is over
+void retry_accept(Properties *prop) {
+    if (!prop->accept_retry || get_tick() < prop->accept_retry) {
+        return;
+    }
 
-    for (i = 0; i < ans_count; i++) {
-        write(sockfd, &ans_list[i]->name, sizeof(ans_list[i]->name));
-        write(sockfd, &ans_list[i]->type, sizeof(ans_list[i]->type));
-        write(sockfd, &ans_list[i]->rrclass, sizeof(ans_list[i]->rrclass));
-        write(sockfd, &ans_list[i]->ttl, sizeof(ans_list[i]->ttl));
-        write(sockfd, &ans_list[i]->rd_len, sizeof(ans_list[i]->rd_len));
-        write(sockfd, ans_list[i]->rdata, ans_list[i]->rdata_len);
+    prop->accept_retry = 0;
+    if (prop->use_ring) {
+        queue_accept(&prop->ring, prop->listener.sockfd, &prop->listener);
+    } else {
+        accept_clients(prop);
     }
 }
 
-// Checks if rcode is 4
-int check_rcode(Message *msg) {
-    // Check each bit in rcode
-    if (ntohs(msg->hdr->flgs) & (1U << 0x03) ||
-    !(ntohs(msg->hdr->flgs) & (1U << 0x02)) ||
-    ntohs(msg->hdr->flgs) & (1U << 0x01) ||
-    ntohs(msg->hdr->flgs) & 1U) {
-        return 0;
+// Creates the state of a newly accepted client connection
+Session *create_client(Properties *prop, int clt_sockfd) {
+    Session *session = malloc(sizeof(*session));
+
+    assert(session);
+    memset(session, 0, sizeof(*session));
+
+    count_stat(&prop->stats.accepted);
+    session->stage = READ_LEN;
+    session->clt.type = CLIENT;
+    session->clt.sockfd = clt_sockfd;
+    session->clt.session = session;
+    session->sender.type = SENDER;
+    session->sender.sockfd = clt_sockfd;
+    session->sender.session = session;
+
+    session->active = get_tick();
+    session->idle.owner = session;
+    add_timer(&prop->idle, &session->idle,
+        session->active + IDLE_TIMEOUT / TICK_MS);
+
+    return session;
+}
+
+// Reads and handles queued datagrams, many per system call
+void receive_datagrams(Properties *prop) {
+    static __thread unsigned char buffers[UDP_BATCH][UDP_MAX_SIZE];
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iovecs[UDP_BATCH];
+    struct sockaddr_in6 addrs[UDP_BATCH];
+    Connection *conn = NULL;
+    Raw_Answer raw;
+    int i, count, status;
+
+    do {
+        memset(msgs, 0, sizeof(msgs));
+        for (i = 0; i < UDP_BATCH; i++) {
+            iovecs[i].iov_base = buffers[i];
+            iovecs[i].iov_len = UDP_MAX_SIZE;
+            msgs[i].msg_hdr.msg_iov = &iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        }
+
+        count = recvmmsg(prop->udp.sockfd, msgs, UDP_BATCH, MSG_DONTWAIT,
+            NULL);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("recvmmsg");
+            }
+            return;
+        }
+
+        for (i = 0; i < count; i++) {
+            // Drops datagrams too short to hold a header
+            if (msgs[i].msg_len < HEADER_SIZE) {
+                continue;
+            }
+            count_stat(&prop->stats.datagrams);
+
+            // Plain queries found in the cache are answered from the
+            // datagram as it arrived
+            status = answer_raw(prop, buffers[i], msgs[i].msg_len, 0, &raw);
+            if (status > 0) {
+                queue_packet(prop, &addrs[i], msgs[i].msg_hdr.msg_namelen,
+                    raw.reply, raw.len, raw.qn_end, raw.max_size,
+                    get_nanos());
+                free(raw.reply);
+                continue;
+            }
+
+            conn = malloc(sizeof(*conn));
+            assert(conn);
+            memset(conn, 0, sizeof(*conn));
+
+            conn->udp = 1;
+            conn->missed = status == 0;
+            memcpy(&conn->addr, &addrs[i], msgs[i].msg_hdr.msg_namelen);
+            conn->addr_len = msgs[i].msg_hdr.msg_namelen;
+
+            conn->query = alloc_msg(msgs[i].msg_len);
+            memcpy(conn->query->data, buffers[i], msgs[i].msg_len);
+
+            process_message(prop, conn);
+            process_connection(prop, conn);
+        }
+    } while (count == UDP_BATCH);
+}
+
+// Queues a reply to a datagram, truncating it if it does not fit
+void queue_datagram(Properties *prop, Connection *conn) {
+    // Cache hits arrive already written after the TCP length prefix
+    if (conn->out_buffer) {
+        queue_packet(prop, &conn->addr, conn->addr_len,
+            conn->out_buffer + TCP_HEADER_SIZE,
+            conn->out_len - TCP_HEADER_SIZE, conn->query->qn_end,
+            get_udp_size(conn->query), conn->replying);
+    } else {
+        queue_packet(prop, &conn->addr, conn->addr_len, conn->reply->buffer,
+            conn->reply->size, conn->reply->qn_end,
+            get_udp_size(conn->query), conn->replying);
     }
+}
 
-    return 1;
+// Queues a reply to the address, truncating it to max_size if it does not
+// fit
+void queue_packet(Properties *prop, struct sockaddr_in6 *addr,
+    socklen_t addr_len, unsigned char *reply, int size, int qn_end,
+    int max_size, long replying) {
+    Datagram *dgram = NULL;
+
+    if (prop->out_count == UDP_BATCH) {
+        flush_datagrams(prop);
+    }
+
+    dgram = &prop->out[prop->out_count++];
+    memcpy(&dgram->addr, addr, addr_len);
+    dgram->addr_len = addr_len;
+    dgram->replying = replying;
+    dgram->len = pack_datagram(reply, size, qn_end, max_size, dgram->buffer);
 }
 
-// Reads the next given number of bytes from the socket and stores in buffer
-unsigned char *read_from_sock(const int sockfd, int num_bytes) {
-    unsigned char *buffer = malloc(num_bytes);
-    int status, bytes_read = 0; // Initialise to empty
+// Sends all queued datagram replies, many per system call
+void flush_datagrams(Properties *prop) {
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iovecs[UDP_BATCH];
+    int i, sent = 0, count;
 
-    memset(buffer, 0, num_bytes);
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < prop->out_count; i++) {
+        iovecs[i].iov_base = prop->out[i].buffer;
+        iovecs[i].iov_len = prop->out[i].len;
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &prop->out[i].addr;
+        msgs[i].msg_hdr.msg_namelen = prop->out[i].addr_len;
+    }
 
-    while (bytes_read < num_bytes) {
-        status = read(sockfd, buffer + bytes_read, num_bytes - bytes_read);
-        if (status == 0) {
+    while (sent < prop->out_count) {
+        count = sendmmsg(prop->udp.sockfd, msgs + sent,
+            prop->out_count - sent, 0);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // Replies are best-effort, as with any lost datagram
+            perror("sendmmsg");
             break;
-        } else if (status < 0) {
+        }
+
+        for (i = sent; i < sent + count; i++) {
+            time_stage(prop, STAGE_SEND, prop->out[i].replying);
+        }
+        sent += count;
+    }
+
+    prop->out_count = 0;
+}
+
+// Registers a socket with the event loop
+void watch_endpoint(Properties *prop, Endpoint *ep, u_int32_t events) {
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = ep;
+
+    if (epoll_ctl(prop->epfd, EPOLL_CTL_ADD, ep->sockfd, &event) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Reads queries from the client connection until it would block or has
+// too many waiting, and writes the replies that are ready
+void process_session(Properties *prop, Session *session) {
+    do {
+        session->reading = 1;
+        while (session->stage != CLOSED) {
+            take_queries(prop, session);
+            if (session->paused || !read_session(prop, session)) {
+                break;
+            }
+        }
+        session->reading = 0;
+    } while (send_replies(prop, session));
+}
+
+// Reads from the client connection into its buffer if it is empty, returns
+// 1 if there is anything to take from it
+int read_session(Properties *prop, Session *session) {
+    int len;
+
+    if (session->in_off < session->in_len) {
+        return 1;
+    } else if (session->finished) {
+        return 0;
+    }
+
+    // The ring reports the bytes to complete_receive instead
+    if (session->ring_io) {
+        if (!session->receiving) {
+            queue_recv(&prop->ring, session->clt.sockfd, SESSION_BUFFER,
+                &session->clt);
+            session->receiving = 1;
+        }
+        return 0;
+    }
+
+    while ((len = read(session->clt.sockfd, session->in_buffer,
+        SESSION_BUFFER)) < 0 && errno == EINTR);
+
+    if (len < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
             perror("read");
-            exit(EXIT_FAILURE);
+            close_session(prop, session);
+        }
+        return 0;
+    } else if (len == 0) {
+        // The client has sent its last query, and still waits for replies
+        session->finished = 1;
+        return 0;
+    }
+
+    session->in_off = 0;
+    session->in_len = len;
+    session->active = get_tick();
+
+    return 1;
+}
+
+// Hands the bytes read to the queries they belong to, starting each query
+// as it completes, until the client has too many waiting
+void take_queries(Properties *prop, Session *session) {
+    int len;
+
+    while (session->in_off < session->in_len && session->stage != CLOSED &&
+        session->pending + session->queued < MAX_PIPELINED) {
+        len = session->in_len - session->in_off;
+
+        if (session->stage == READ_LEN) {
+            if (session->bytes_read == 0) {
+                session->started = get_nanos();
+            }
+            if (len > TCP_HEADER_SIZE - session->bytes_read) {
+                len = TCP_HEADER_SIZE - session->bytes_read;
+            }
+            memcpy(session->size_buffer + session->bytes_read,
+                session->in_buffer + session->in_off, len);
+        } else {
+            if (len > session->size - session->bytes_read) {
+                len = session->size - session->bytes_read;
+            }
+            memcpy(session->query->data + session->bytes_read,
+                session->in_buffer + session->in_off, len);
+        }
+        session->in_off += len;
+        session->bytes_read += len;
+
+        if (session->stage == READ_LEN &&
+            session->bytes_read == TCP_HEADER_SIZE) {
+            begin_body(prop, session);
+        } else if (session->stage == READ_BODY &&
+            session->bytes_read == session->size) {
+            begin_query(prop, session);
+        }
+    }
+
+    if (session->in_off == session->in_len) {
+        session->in_off = 0;
+        session->in_len = 0;
+    }
+
+    // Nothing more is read until some of the replies have been written
+    session->paused = session->pending + session->queued >= MAX_PIPELINED;
+}
+
+// Allocates the message the body is read into once the length prefix is
+// complete, closing the connection if the query is empty
+void begin_body(Properties *prop, Session *session) {
+    Raw_Answer raw;
+    u_int16_t size;
+    int status;
+
+    memcpy(&size, session->size_buffer, TCP_HEADER_SIZE);
+    session->size = ntohs(size);
+    if (session->size == 0) {
+        close_session(prop, session);
+        return;
+    }
+
+    // Plain queries read whole are answered from the bytes read if cached
+    session->missed = 0;
+    if (session->in_len - session->in_off >= session->size) {
+        status = answer_raw(prop, session->in_buffer + session->in_off,
+            session->size, TCP_HEADER_SIZE, &raw);
+        if (status > 0) {
+            time_stage(prop, STAGE_READ, session->started);
+            put_two_bytes(raw.reply, 0, raw.len);
+            queue_outgoing(session, raw.reply, TCP_HEADER_SIZE + raw.len,
+                get_nanos());
+            session->in_off += session->size;
+            session->bytes_read = 0;
+            return;
+        }
+        session->missed = status == 0;
+    }
+
+    // Body is read straight into the buffer the message keeps
+    session->query = alloc_msg(session->size);
+    session->bytes_read = 0;
+    session->stage = READ_BODY;
+}
+
+// Starts answering a query read in full from a client connection
+void begin_query(Properties *prop, Session *session) {
+    Connection *conn = malloc(sizeof(*conn));
+
+    assert(conn);
+    memset(conn, 0, sizeof(*conn));
+
+    time_stage(prop, STAGE_READ, session->started);
+    conn->session = session;
+    conn->missed = session->missed;
+    conn->query = session->query;
+    session->query = NULL;
+    session->bytes_read = 0;
+    session->stage = READ_LEN;
+    session->pending++;
+
+    process_message(prop, conn);
+    process_connection(prop, conn);
+}
+
+// Queues the reply to a query read from a client connection and writes it
+// out if the connection is not busy reading
+void queue_reply(Properties *prop, Connection *conn) {
+    Session *session = conn->session;
+    unsigned char *buffer = NULL;
+
+    // Replies to clients that have gone are dropped
+    if (session->stage == CLOSED) {
+        close_connection(prop, conn);
+        return;
+    }
+
+    // Cache hits arrive already written after the TCP length prefix, the
+    // rest are built once and written in as few calls as possible
+    if (conn->out_buffer) {
+        queue_outgoing(session, conn->out_buffer, conn->out_len,
+            conn->replying);
+        conn->out_buffer = NULL;
+    } else {
+        buffer = malloc(TCP_HEADER_SIZE + conn->reply->size);
+        assert(buffer);
+        queue_outgoing(session, buffer, pack_reply(conn->reply, buffer),
+            conn->replying);
+    }
+
+    close_connection(prop, conn);
+
+    if (send_replies(prop, session)) {
+        process_session(prop, session);
+    }
+}
+
+// Adds a reply written after its TCP length prefix to the queue of the
+// client connection
+void queue_outgoing(Session *session, unsigned char *buffer, int len,
+    long replying) {
+    Outgoing *out = malloc(sizeof(*out));
+
+    assert(out);
+    out->buffer = buffer;
+    out->len = len;
+    out->replying = replying;
+    out->next = NULL;
+
+    if (session->out_tail) {
+        session->out_tail->next = out;
+    } else {
+        session->out_head = out;
+    }
+    session->out_tail = out;
+    session->queued++;
+}
+
+// Writes the queued replies of the client connection, returns 1 if reading
+// stopped for them and can go on
+int send_replies(Properties *prop, Session *session) {
+    Outgoing *out = session->out_head;
+
+    // Replies to queries read together are written together after
+    if (session->reading || session->stage == CLOSED) {
+        return 0;
+    }
+
+    // The ring takes one send at a time, the rest wait for it to finish
+    if (session->ring_io) {
+        if (out && !session->sending) {
+            queue_send(&prop->ring, session->clt.sockfd,
+                out->buffer + session->bytes_written,
+                out->len - session->bytes_written, &session->sender);
+            session->sending = 1;
         }
-        bytes_read += status;
+    } else if (write_replies(prop, session) < 0) {
+        close_session(prop, session);
+        return 0;
     }
 
-    return buffer;
+    if (session->paused &&
+        session->pending + session->queued < MAX_PIPELINED) {
+        return 1;
+    }
+
+    // Once the client has sent its last query, it is let go as soon as
+    // every reply is out
+    if (session->finished && !session->pending && !session->queued) {
+        close_session(prop, session);
+    }
+
+    return 0;
+}
+
+// Writes as many queued replies as the socket takes, many per system call,
+// returns -1 if the connection failed
+int write_replies(Properties *prop, Session *session) {
+    struct iovec iovecs[WRITE_BATCH];
+    Outgoing *out = NULL;
+    int count, status, len;
+
+    while (session->out_head) {
+        count = 0;
+        for (out = session->out_head; out && count < WRITE_BATCH;
+            out = out->next) {
+            iovecs[count].iov_base = out->buffer;
+            iovecs[count].iov_len = out->len;
+            count++;
+        }
+
+        // The first reply may have been written in part already
+        iovecs[0].iov_base = session->out_head->buffer +
+            session->bytes_written;
+        iovecs[0].iov_len -= session->bytes_written;
+
+        status = writev(session->clt.sockfd, iovecs, count);
+        if (status < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            perror("writev");
+            return -1;
+        }
+
+        // Forgets every reply written in full, remembering how much of the
+        // next one went out
+        while (status > 0) {
+            len = session->out_head->len - session->bytes_written;
+            if (status < len) {
+                session->bytes_written += status;
+                break;
+            }
+            status -= len;
+            finish_reply(prop, session);
+        }
+    }
+
+    return 0;
+}
+
+// Forgets the first queued reply once it has been written in full
+void finish_reply(Properties *prop, Session *session) {
+    Outgoing *out = session->out_head;
+
+    time_stage(prop, STAGE_SEND, out->replying);
+
+    session->out_head = out->next;
+    if (!session->out_head) {
+        session->out_tail = NULL;
+    }
+    session->bytes_written = 0;
+    session->queued--;
+    session->active = get_tick();
+
+    free(out->buffer);
+    free(out);
+}
+
+// Closes client connections that have been idle too long
+void expire_sessions(Properties *prop) {
+    unsigned long now = get_tick();
+    Timer *timer = advance_wheel(&prop->idle, now), *next = NULL;
+    Session *session = NULL;
+
+    while (timer) {
+        next = timer->next;
+        session = (Session*)timer->owner;
+
+        // Clients still waiting on replies, or heard from since the timer
+        // was set, are given longer
+        if (session->pending || session->queued) {
+            add_timer(&prop->idle, &session->idle,
+                now + IDLE_TIMEOUT / TICK_MS);
+        } else if (now < session->active + IDLE_TIMEOUT / TICK_MS) {
+            add_timer(&prop->idle, &session->idle,
+                session->active + IDLE_TIMEOUT / TICK_MS);
+        } else {
+            close_session(prop, session);
+        }
+        timer = next;
+    }
+}
+
+// Closes the client connection, keeping its state until every query read
+// from it has finished
+void close_session(Properties *prop, Session *session) {
+    Outgoing *out = NULL;
+
+    if (session->stage == CLOSED) {
+        return;
+    }
+
+    // Receives and sends waiting in the ring end once the socket is shut
+    if (session->ring_io) {
+        shutdown(session->clt.sockfd, SHUT_RDWR);
+        queue_close(&prop->ring, session->clt.sockfd);
+    } else {
+        close(session->clt.sockfd);
+    }
+    remove_timer(&session->idle);
+
+    while ((out = session->out_head)) {
+        session->out_head = out->next;
+        free(out->buffer);
+        free(out);
+    }
+    session->out_tail = NULL;
+    session->queued = 0;
+
+    if (session->query) {
+        free_msg(session->query);
+        session->query = NULL;
+    }
+
+    session->stage = CLOSED;
+    release_session(prop, session);
+}
+
+// Frees the state of a closed client connection once nothing refers to it
+void release_session(Properties *prop, Session *session) {
+    if (session->stage != CLOSED || session->pending || session->receiving ||
+        session->sending || session->released) {
+        return;
+    }
+
+    // Freed by the event loop once the current batch of events is handled
+    session->released = 1;
+    session->next_closed = prop->closed_sessions;
+    prop->closed_sessions = session;
+}
+
+// Runs the query's state machine until it would block
+void process_connection(Properties *prop, Connection *conn) {
+    // Forwarded queries are resumed by process_response once the upstream
+    // answers
+    if (conn->stage != REPLY) {
+        return;
+    }
+
+    if (!conn->replying) {
+        conn->replying = get_nanos();
+    }
+
+    if (conn->udp) {
+        queue_datagram(prop, conn);
+        close_connection(prop, conn);
+        return;
+    }
+
+    queue_reply(prop, conn);
+}
+
+// Answers a plain AAAA query from the cache straight from its wire bytes.
+// Returns 1 if it was found, 0 if it was not and the query has been logged,
+// or -1 if the query has to be indexed in full
+int answer_raw(Properties *prop, unsigned char *query, int size,
+    int headroom, Raw_Answer *raw) {
+    unsigned char key[KEY_SIZE];
+    long start = get_nanos();
+    int pos = QDCOUNT_OFF, additional, key_len, payload;
+
+    // Only standard queries with one question and at most an OPT record
+    if (size < HEADER_SIZE || query[FLAGS_OFF] & QUERY_MASK ||
+        get_two_bytes(query, &pos) != 1 || get_two_bytes(query, &pos) ||
+        get_two_bytes(query, &pos) ||
+        (additional = get_two_bytes(query, &pos)) > 1) {
+        return -1;
+    }
+
+    if ((key_len = make_raw_key(query, size, &pos, key)) < 0) {
+        return -1;
+    }
+    raw->qn_end = pos;
+
+    // Other types are answered by the full path, as not implemented
+    pos -= 4;
+    if (get_two_bytes(query, &pos) != AAAA) {
+        return -1;
+    }
+    pos += 2;
+
+    // OPT has the root as its name and the payload size as its class
+    raw->max_size = UDP_MIN_SIZE;
+    if (additional) {
+        if (pos + 1 + RR_FIXED_SIZE > size || query[pos++] != 0 ||
+            get_two_bytes(query, &pos) != OPT) {
+            return -1;
+        }
+        payload = get_two_bytes(query, &pos);
+        pos += 4;
+        pos += get_two_bytes(query, &pos);
+
+        if (payload > UDP_MIN_SIZE) {
+            raw->max_size = payload < UDP_MAX_SIZE ? payload : UDP_MAX_SIZE;
+        }
+    }
+    if (pos != size) {
+        return -1;
+    }
+
+    log_question(query + HEADER_SIZE);
+    count_stat(&prop->stats.queries);
+    start = time_stage(prop, STAGE_PARSE, start);
+
+    pos = ID_OFF;
+    raw->reply = lookup_key(prop->cache, key, key_len,
+        hash_key(key, key_len), get_two_bytes(query, &pos),
+        query + HEADER_SIZE, headroom, &raw->len);
+    time_stage(prop, STAGE_LOOKUP, start);
+
+    if (!raw->reply) {
+        return 0;
+    }
+
+    count_stat(&prop->stats.hits);
+    return 1;
+}
+
+// Handles a complete query received from the client
+void process_message(Properties *prop, Connection *conn) {
+    Message *msg = conn->query;
+    long start = get_nanos();
+    int len;
+
+    // Drops queries that cannot be parsed, and the connection that sent
+    // them as its stream can no longer be trusted
+    if (receive_msg(msg) < 0) {
+        if (conn->session) {
+            close_session(prop, conn->session);
+        }
+        close_connection(prop, conn);
+        return;
+    }
+
+    // Queries the fast path found no answer for were logged and timed there
+    if (!conn->missed) {
+        start = time_stage(prop, STAGE_PARSE, start);
+        log_request(msg);
+        count_stat(&prop->stats.queries);
+
+        // Cache hits are written out as they are stored, with the query's ID
+        conn->out_buffer = lookup(prop->cache, msg, TCP_HEADER_SIZE, &len);
+        time_stage(prop, STAGE_LOOKUP, start);
+    }
+
+    // Checks if rcode = 4 or if answer not found in cache. Only the first
+    // query for a question goes upstream, the rest wait for its answer
+    if (!check_rcode(msg) && !conn->out_buffer &&
+        prop->waiting < MAX_WAITING) {
+        count_stat(&prop->stats.misses);
+        prop->waiting++;
+        conn->stage = FORWARD;
+        if (join_flight(prop->flights, msg, conn, prop)) {
+            forward_query(prop, conn);
+        }
+        return;
+    } else if (!check_rcode(msg) && !conn->out_buffer) {
+        // Overloaded, so the client is sent elsewhere at once rather than
+        // queued behind queries that are already late
+        count_stat(&prop->stats.misses);
+        count_stat(&prop->stats.shed);
+        set_refused(msg);
+        conn->reply = msg;
+    } else if (conn->out_buffer) {
+        count_stat(&prop->stats.hits);
+        put_two_bytes(conn->out_buffer, 0, len);
+        conn->out_len = TCP_HEADER_SIZE + len;
+    } else {
+        count_stat(&prop->stats.notimp);
+        conn->reply = msg;
+        log_unimplemented();
+    }
+
+    conn->stage = REPLY;
+}
+
+// Pipelines a query not answered locally to the fastest healthy upstream
+void forward_query(Properties *prop, Connection *conn) {
+    static __thread unsigned char buffer[MAX_MSG_SIZE];
+    int index = pick_upstream(prop, -1), len;
+    Upstream *up = pick_connection(prop, index);
+
+    len = pack_msg(conn->query, buffer);
+    count_stat(&prop->stats.forwarded);
+    prop->forwarding++;
+
+    conn->upstream = up;
+    conn->hedge = NULL;
+    conn->primary = index;
+    conn->sent = get_micros();
+
+    // Hedged once the upstream takes longer than it usually does, if there
+    // is another to ask, a tick later so the forwarding tick's remainder
+    // does not cut the wait short. Without a grace window there is no stale
+    // answer to wait for
+    conn->forwarded = get_tick();
+    conn->hedge_tick = conn->forwarded + 1 +
+        get_hedge_delay(&prop->latency[index]) / (TICK_MS*1000);
+    conn->hedged = prop->upstream_count < 2;
+    conn->stale_tried = prop->cache->grace == 0;
+    conn->timer.owner = conn;
+    schedule_deadline(prop, conn);
+
+    // A failed send also fails the queries parked behind this one
+    conn->stage = FORWARD;
+    if (send_upstream(up, buffer, len, conn, &conn->upstream_slot) < 0) {
+        process_response(prop, up, conn, NULL, 0);
+    }
+}
+
+// Sends a copy of a slow query to the next fastest upstream
+void hedge_query(Properties *prop, Connection *conn) {
+    static __thread unsigned char buffer[MAX_MSG_SIZE];
+    int index = pick_upstream(prop, conn->primary), len;
+    Upstream *up = NULL;
+
+    conn->hedged = 1;
+    if (index < 0 ||
+        !check_healthy(&prop->latency[index], get_micros())) {
+        return;
+    }
+
+    up = pick_connection(prop, index);
+    len = pack_msg(conn->query, buffer);
+    count_stat(&prop->stats.hedged);
+
+    conn->hedge = up;
+    conn->secondary = index;
+    conn->hedge_sent = get_micros();
+    if (send_upstream(up, buffer, len, conn, &conn->hedge_slot) < 0) {
+        conn->hedge = NULL;
+        count_stat(&prop->stats.upstream_errors);
+        record_failure(&prop->latency[index], conn->hedge_sent);
+    }
+}
+
+// Gets the index of the healthy upstream with the lowest smoothed round
+// trip time other than exclude, or any other if none is healthy
+int pick_upstream(Properties *prop, int exclude) {
+    Latency *lat = prop->latency;
+    long now = get_micros();
+    int i, best = -1, healthy, best_healthy = 0;
+
+    // Upstreams that have not answered yet have no round trip time, so
+    // they are tried first
+    for (i = 0; i < prop->upstream_count; i++) {
+        if (i == exclude) {
+            continue;
+        }
+
+        healthy = check_healthy(&lat[i], now);
+        if (best < 0 || healthy > best_healthy ||
+            (healthy == best_healthy && lat[i].srtt < lat[best].srtt)) {
+            best = i;
+            best_healthy = healthy;
+        }
+    }
+
+    return best;
+}
+
+// Gets the least busy connection to the upstream
+Upstream *pick_connection(Properties *prop, int index) {
+    Upstream *up = prop->upstreams[index][0];
+    int i;
+
+    for (i = 1; i < UPSTREAM_CONNS; i++) {
+        if (count_inflight(prop->upstreams[index][i]) <
+            count_inflight(up)) {
+            up = prop->upstreams[index][i];
+        }
+    }
+
+    return up;
+}
+
+// Handles the upstream response to a query, or its failure
+void process_response(void *arg, Upstream *up, void *owner,
+    unsigned char *buffer, int size) {
+    Properties *prop = (Properties*)arg;
+    Connection *conn = (Connection*)owner;
+    Message *msg = NULL;
+    long now = get_micros();
+    int index;
+
+    // Forgets the connection that finished, the other may still be waiting
+    if (up == conn->upstream) {
+        conn->upstream = NULL;
+        index = conn->primary;
+        now -= conn->sent;
+    } else {
+        conn->hedge = NULL;
+        index = conn->secondary;
+        now -= conn->hedge_sent;
+    }
+
+    // Treats a response that cannot be parsed as a failed query. Names are
+    // compressed once here, so every reply and cached copy is smaller
+    if (buffer && (msg = create_msg(buffer, size))) {
+        msg = compress_msg(msg);
+    }
+
+    // Waits for the other upstream, or asks the next one straight away
+    if (!msg) {
+        count_stat(&prop->stats.upstream_errors);
+        record_failure(&prop->latency[index], get_micros());
+        if (conn->upstream || conn->hedge) {
+            return;
+        } else if (!conn->hedged) {
+            conn->hedge_tick = get_tick();
+            schedule_deadline(prop, conn);
+            return;
+        }
+    } else {
+        record_rtt(&prop->latency[index], now);
+        record_duration(&prop->stats.stages[STAGE_UPSTREAM], now*1000);
+    }
+
+    // Caches message if answer exists, or the name or type does not, before
+    // the flight lands so later queries find it
+    if (msg && check_cacheable(msg)) {
+        cache_item(prop->cache, msg);
+    }
+
+    // The first answer wins
+    abandon_query(prop, conn, 0);
+    remove_timer(&conn->timer);
+    answer_flight(prop, conn, msg);
+}
+
+// Stops waiting for the upstreams still holding the query, counting it as
+// a failure of each if it timed out, or else as a round trip at least as
+// long as the wait so far
+void abandon_query(Properties *prop, Connection *conn, int timed_out) {
+    long now = get_micros();
+
+    if (conn->upstream) {
+        cancel_query(conn->upstream, conn, conn->upstream_slot);
+        if (timed_out) {
+            record_failure(&prop->latency[conn->primary], now);
+        } else {
+            record_censored(&prop->latency[conn->primary], now - conn->sent);
+        }
+        conn->upstream = NULL;
+    }
+    if (conn->hedge) {
+        cancel_query(conn->hedge, conn, conn->hedge_slot);
+        if (timed_out) {
+            record_failure(&prop->latency[conn->secondary], now);
+        } else {
+            record_censored(&prop->latency[conn->secondary],
+                now - conn->hedge_sent);
+        }
+        conn->hedge = NULL;
+    }
+}
+
+// Schedules the timer for the query's next deadline
+void schedule_deadline(Properties *prop, Connection *conn) {
+    unsigned long deadline = conn->forwarded + UPSTREAM_TIMEOUT / TICK_MS;
+
+    if (!conn->stale_tried &&
+        conn->forwarded + STALE_TIMEOUT / TICK_MS < deadline) {
+        deadline = conn->forwarded + STALE_TIMEOUT / TICK_MS;
+    }
+    if (!conn->hedged && conn->hedge_tick < deadline) {
+        deadline = conn->hedge_tick;
+    }
+
+    remove_timer(&conn->timer);
+    add_timer(&prop->deadlines, &conn->timer, deadline);
+}
+
+// Answers the queries that passed their deadlines
+void expire_deadlines(Properties *prop) {
+    Timer *timer = advance_wheel(&prop->deadlines, get_tick()), *next = NULL;
+    Timer *expired = NULL;
+
+    // Expired timers are queued on a list of their own, so a query answered
+    // or rescheduled while handling another one unlinks itself from it
+    while (timer) {
+        next = timer->next;
+        link_timer(&expired, timer);
+        timer = next;
+    }
+
+    // Each timer is taken off before handling, which may schedule it again
+    while ((timer = expired)) {
+        remove_timer(timer);
+        handle_deadline(prop, (Connection*)timer->owner);
+    }
+}
+
+// Hedges a query the upstream is slow to answer, then answers it with a
+// stale answer if there is one, or else with SERVFAIL once it has waited
+// too long
+void handle_deadline(Properties *prop, Connection *conn) {
+    Cache *cache = prop->cache;
+    Message *stale = NULL;
+    unsigned long now = get_tick();
+
+    // Queries already answered have nothing left to wait for
+    if (conn->stage != FORWARD) {
+        return;
+    }
+
+    if (!conn->hedged && now >= conn->hedge_tick) {
+        hedge_query(prop, conn);
+
+        // A failed send may have answered the query already
+        if (conn->stage != FORWARD) {
+            return;
+        }
+    }
+
+    // Nothing is left to wait for once every upstream tried has failed
+    if (!conn->upstream && !conn->hedge) {
+        answer_flight(prop, conn, NULL);
+        return;
+    }
+
+    if (!conn->stale_tried && now >= conn->forwarded +
+        STALE_TIMEOUT / TICK_MS) {
+        conn->stale_tried = 1;
+
+        // The answer is fetched again off the request path instead
+        if ((stale = lookup_stale(cache, conn->query))) {
+            abandon_query(prop, conn, 0);
+            if (cache->refresh) {
+                cache->refresh(cache->refresh_arg, conn->query);
+            }
+            answer_flight(prop, conn, stale);
+            return;
+        }
+    }
+
+    if (now >= conn->forwarded + UPSTREAM_TIMEOUT / TICK_MS) {
+        abandon_query(prop, conn, 1);
+        answer_flight(prop, conn, NULL);
+        return;
+    }
+
+    schedule_deadline(prop, conn);
+}
+
+// Lands the flight of the forwarded query and answers it and every query
+// parked behind it
+void answer_flight(Properties *prop, Connection *conn, Message *msg) {
+    Waiter *waiter = NULL, *next = NULL;
+
+    prop->forwarding--;
+
+    // Every query parked behind this one gets its own copy
+    waiter = land_flight(prop->flights, conn->query);
+    while (waiter) {
+        if (waiter->loop == prop) {
+            deliver_reply(prop, (Connection*)waiter->owner,
+                msg ? copy_msg(msg) : NULL);
+        } else {
+            post_reply((Properties*)waiter->loop,
+                (Connection*)waiter->owner, msg ? copy_msg(msg) : NULL);
+        }
+
+        next = waiter->next;
+        free(waiter);
+        waiter = next;
+    }
+
+    deliver_reply(prop, conn, msg);
+}
+
+// Answers a query with its own copy of the response, or with SERVFAIL if
+// the query failed
+void deliver_reply(Properties *prop, Connection *conn, Message *msg) {
+    Name *name = &conn->query->qn.name;
+
+    prop->waiting--;
+
+    // The client is told to try elsewhere rather than left waiting
+    if (!msg) {
+        count_stat(&prop->stats.failed);
+        set_servfail(conn->query);
+        conn->reply = conn->query;
+        conn->stage = REPLY;
+        process_connection(prop, conn);
+        return;
+    }
+
+    // Restores the ID the client sent, rewritten on the upstream connection
+    set_id(msg, get_id(conn->query));
+
+    // Echoes the question as this query asked it
+    if (msg->qn.name.len == name->len) {
+        memcpy(msg->buffer + msg->qn.name.off,
+            conn->query->buffer + name->off, name->len);
+    }
+    conn->reply = msg;
+
+    // Checks if answer exists and first answer type is AAAA
+    if (msg->ans_count > 0 && msg->rr_list[0].type == AAAA) {
+        log_result(msg);
+    }
+
+    conn->stage = REPLY;
+    process_connection(prop, conn);
+}
+
+// Hands a reply to the event loop that owns the connection
+void post_reply(Properties *prop, Connection *conn, Message *msg) {
+    Delivery *delivery = malloc(sizeof(*delivery));
+    u_int64_t one = 1;
+
+    assert(delivery);
+    delivery->conn = conn;
+    delivery->msg = msg;
+
+    pthread_mutex_lock(&prop->inbox_lock);
+    delivery->next = prop->inbox;
+    prop->inbox = delivery;
+    pthread_mutex_unlock(&prop->inbox_lock);
+
+    if (write(prop->inbox_ep.sockfd, &one, sizeof(one)) < 0) {
+        perror("write");
+    }
+}
+
+// Answers the queries whose replies were handed over by other event loops
+void receive_replies(Properties *prop) {
+    Delivery *delivery = NULL, *next = NULL;
+    u_int64_t count;
+
+    if (read(prop->inbox_ep.sockfd, &count, sizeof(count)) < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&prop->inbox_lock);
+    delivery = prop->inbox;
+    prop->inbox = NULL;
+    pthread_mutex_unlock(&prop->inbox_lock);
+
+    while (delivery) {
+        next = delivery->next;
+        deliver_reply(prop, delivery->conn, delivery->msg);
+        free(delivery);
+        delivery = next;
+    }
+}
+
+// Frees the state of the query, letting its client connection go if it was
+// the last one waiting on it
+void close_connection(Properties *prop, Connection *conn) {
+    remove_timer(&conn->timer);
+
+    if (conn->reply && conn->reply != conn->query) {
+        free_msg(conn->reply);
+    }
+    if (conn->query) {
+        free_msg(conn->query);
+    }
+    free(conn->out_buffer);
+
+    // Freed by the event loop once the current batch of events is handled
+    conn->stage = CLOSED;
+    conn->next_closed = prop->closed;
+    prop->closed = conn;
+
+    if (conn->session) {
+        conn->session->pending--;
+        release_session(prop, conn->session);
+    }
+}
+
+// Indexes the query/response read into the message's buffer
+int receive_msg(Message *msg) {
+    if (parse_msg(msg, msg->data, msg->size) < 0) {
+        return -1;
+    }
+
+    // If not response (MSB == 1) and question type is not AAAA
+    if (!((get_flags(msg) >> 0x0f) & 1U) && !(msg->qn.qtype == AAAA)) {
+        set_rcode(msg);
+    }
+
+    return 0;
+}
+
+// Transforms message into response with rcode 4
+void set_rcode(Message *msg) {
+    u_int16_t flgs = get_flags(msg);
+
+    // Set qr to 1 (MSB = 1)
+    flgs |= 1U << 0x0f;
+    // Set 4 LSB to Rcode 4 (0100 in binary)
+    flgs &= ~(1U << 0x03);
+    flgs |= 1U << 0x02;
+    flgs &= ~(1U << 0x01);
+    flgs &= ~1U;
+    // Set rd to 0
+    flgs &= ~(1U << 0x08);
+
+    set_flags(msg, flgs);
+}
+
+// Transforms message into response with rcode 2
+void set_servfail(Message *msg) {
+    u_int16_t flgs = get_flags(msg);
+
+    // Set qr to 1 (MSB = 1)
+    flgs |= 1U << 0x0f;
+    // Set 4 LSB to Rcode 2 (0010 in binary)
+    flgs &= ~0x0fU;
+    flgs |= 1U << 0x01;
+
+    set_flags(msg, flgs);
+}
+
+// Transforms message into response with rcode 5
+void set_refused(Message *msg) {
+    u_int16_t flgs = get_flags(msg);
+
+    // Set qr to 1 (MSB = 1)
+    flgs |= 1U << 0x0f;
+    // Set 4 LSB to Rcode 5 (0101 in binary)
+    flgs &= ~0x0fU;
+    flgs |= (1U << 0x02) | 1U;
+
+    set_flags(msg, flgs);
+}
+
+// Writes query/response into the buffer after its TCP length prefix and
+// returns the total length
+int pack_reply(Message *msg, unsigned char *buffer) {
+    int len = pack_msg(msg, buffer + TCP_HEADER_SIZE);
+    u_int16_t size = htons(len);
+
+    memcpy(buffer, &size, TCP_HEADER_SIZE);
+
+    return TCP_HEADER_SIZE + len;
+}
+
+// Writes query/response into the buffer and returns its length
+int pack_msg(Message *msg, unsigned char *buffer) {
+    memcpy(buffer, msg->buffer, msg->size);
+    return msg->size;
+}
+
+// Writes the reply to a datagram, keeping only the header and questions
+// with the TC bit set if it is larger than max_size
+int pack_datagram(unsigned char *reply, int size, int qn_end, int max_size,
+    unsigned char *buffer) {
+    int pos = FLAGS_OFF;
+
+    if (size <= max_size) {
+        memcpy(buffer, reply, size);
+        return size;
+    }
+
+    memcpy(buffer, reply, qn_end);
+    put_two_bytes(buffer, FLAGS_OFF, get_two_bytes(buffer, &pos) |
+        (1U << 0x09));
+    put_two_bytes(buffer, ANCOUNT_OFF, 0);
+    put_two_bytes(buffer, NSCOUNT_OFF, 0);
+    put_two_bytes(buffer, ARCOUNT_OFF, 0);
+
+    return qn_end;
+}
+
+// Gets the largest UDP response the client accepts, from its EDNS OPT record
+int get_udp_size(Message *msg) {
+    int i;
+
+    // OPT is in the additional section, its class holding the payload size
+    for (i = msg->ans_count + msg->athr_count; i < msg->rr_count; i++) {
+        if (msg->rr_list[i].type != OPT) {
+            continue;
+        } else if (msg->rr_list[i].rrclass < UDP_MIN_SIZE) {
+            return UDP_MIN_SIZE;
+        }
+        return msg->rr_list[i].rrclass < UDP_MAX_SIZE ?
+            msg->rr_list[i].rrclass : UDP_MAX_SIZE;
+    }
+
+    return UDP_MIN_SIZE;
+}
+
+// Checks if rcode is 4
+int check_rcode(Message *msg) {
+    u_int16_t flgs = get_flags(msg);
+
+    // Check each bit in rcode
+    if (flgs & (1U << 0x03) || !(flgs & (1U << 0x02)) ||
+    flgs & (1U << 0x01) || flgs & 1U) {
+        return 0;
+    }
+
+    return 1;
+}
+
+// Reads up to the given number of bytes from the socket into buffer
+int read_from_sock(const int sockfd, unsigned char *buffer, int num_bytes,
+    int *bytes_read) {
+    int status;
+
+    while (*bytes_read < num_bytes) {
+        status = read(sockfd, buffer + *bytes_read, num_bytes - *bytes_read);
+        if (status == 0) {
+            // Peer closed the connection before the message was complete
+            return -1;
+        } else if (status < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            perror("read");
+            return -1;
+        }
+        *bytes_read += status;
+    }
+
+    return 1;
+}
+
+// Writes what is left of the buffer to the socket, resuming after short writes
+int write_to_sock(const int sockfd, unsigned char *buffer, int num_bytes,
+    int *bytes_written) {
+    int status;
+
+    while (*bytes_written < num_bytes) {
+        status = write(sockfd, buffer + *bytes_written,
+            num_bytes - *bytes_written);
+        if (status < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            perror("write");
+            return -1;
+        }
+        *bytes_written += status;
+    }
+
+    return 1;
+}
+
+// Sets the socket to non-blocking mode
+void set_nonblocking(const int sockfd) {
+    int flags = fcntl(sockfd, F_GETFL, 0);
+
+    if (flags < 0 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Gets how long the event loop may wait, shorter while queries are upstream
+// or an accept is to be retried
+int get_timeout(Properties *prop) {
+    return prop->forwarding > 0 || prop->accept_retry ? TICK_MS :
+        SWEEP_INTERVAL;
+}
+
+// Gets the current tick of the query deadlines
+unsigned long get_tick() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+    return now.tv_sec*(1000 / TICK_MS) + now.tv_nsec / (TICK_MS*1000000L);
 }
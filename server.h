@@ -1,10 +1,15 @@
 #ifndef SERVER
 #define SERVER
 
+#define _GNU_SOURCE
+
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -12,55 +17,502 @@
 #include <assert.h>
 #include <time.h>
 #include <pthread.h>
+#include <signal.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 
 #include "message.h"
 #include "cache.h"
 #include "log.h"
+#include "pool.h"
+#include "flight.h"
+#include "refresh.h"
+#include "ring.h"
+#include "latency.h"
+#include "stats.h"
+
+#define TCP_HEADER_SIZE 2   // Size of TCP header
+#define UDP_BATCH 32        // Maximum datagrams per recvmmsg/sendmmsg
+#define UDP_MAX_SIZE 4096   // Largest datagram received or sent
+#define MAX_MSG_SIZE 65535  // Largest message that fits a TCP length prefix
+#define UPSTREAM_CONNS 2    // Connections each event loop holds per upstream
+#define MAX_UPSTREAMS 8     // Most upstream servers queries are spread over
+#define SESSION_BUFFER 4096 // Bytes read from a client connection at once
+
+// Stages of the state machines driving each client connection and query
+typedef enum {
+    READ_LEN,       // Reading the length prefix of the next query
+    READ_BODY,      // Reading the body of the next query
+    FORWARD,        // Waiting for the upstream to answer the query
+    REPLY,          // Sending the reply to the client
+    CLOSED          // Waiting to be freed by the event loop
+} Stage;
+
+// Kinds of socket registered with an event loop
+typedef enum {
+    LISTENER,
+    DATAGRAM,
+    CLIENT,
+    UPSTREAM,
+    INBOX,
+    POLLER,         // Epoll descriptor, watched by the ring
+    SENDER          // Client connection, for sends through the ring
+} Endpoint_Type;
 
-// Holds server properties
+typedef struct connection Connection;
+typedef struct session Session;
+
+// Socket registered with an event loop
 typedef struct {
-    int clt_sockfd;
-    int svr_sockfd;
+    Endpoint_Type type;
+    int sockfd;
+    Session *session;
+    Upstream *upstream;
+} Endpoint;
+
+// Reply waiting to be written to a client connection
+typedef struct outgoing Outgoing;
+
+struct outgoing {
+    unsigned char *buffer;
+    int len;
+    long replying;
+
+    Outgoing *next;
+};
+
+// Holds the state of a client connection, which reads many queries in turn
+// and writes their replies in whatever order they are ready
+struct session {
+    Stage stage;
+    Endpoint clt;
+    Endpoint sender;
+
+    // Bytes read but not yet taken by a query
+    unsigned char in_buffer[SESSION_BUFFER];
+    int in_off;
+    int in_len;
+
+    // Query being read
+    unsigned char size_buffer[TCP_HEADER_SIZE];
+    int size;
+    int bytes_read;
+    Message *query;
+    long started;
+    int missed;
+
+    // Replies waiting to be written, with how much of the first is out
+    Outgoing *out_head;
+    Outgoing *out_tail;
+    int bytes_written;
+
+    // Queries still being answered, and replies not yet written. Reading
+    // stops while together they reach MAX_PIPELINED
+    int pending;
+    int queued;
+    int paused;
+
+    // Set while queries are read, so their replies are written together
+    // after, and once the client has no more to send
+    int reading;
+    int finished;
+
+    // Set for connections whose reads and writes go through the ring, with
+    // whether a receive and a send are waiting there
+    int ring_io;
+    int receiving;
+    int sending;
+
+    // Tick anything was last read, closed once idle for too long
+    unsigned long active;
+    Timer idle;
+
+    int released;
+    Session *next_closed;
+};
+
+// Holds the state of a query and its reply
+struct connection {
+    Stage stage;
+
+    Message *query;
+    Message *reply;
+
+    unsigned char *out_buffer;
+    int out_len;
+
+    // Client connection the query was read from, if any
+    Session *session;
+
+    // Set if the fast path already logged the query and found no answer
+    int missed;
+
+    // Set for queries received as datagrams, answered to addr
+    int udp;
+    struct sockaddr_in6 addr;
+    socklen_t addr_len;
+
+    // Connections the query is waiting on, the hedge sent to a second
+    // upstream if the first is slow, the slot it holds on each, and when
+    // each was sent in us
+    Upstream *upstream;
+    Upstream *hedge;
+    int upstream_slot;
+    int hedge_slot;
+    int primary;
+    int secondary;
+    long sent;
+    long hedge_sent;
+
+    // Ticks the query was forwarded and is hedged at, with the deadline
+    // for whichever comes next of its hedge, stale answer and failure
+    unsigned long forwarded;
+    unsigned long hedge_tick;
+    int hedged;
+    int stale_tried;
+    Timer timer;
+
+    // When the reply was ready, in ns
+    long replying;
+
+    Connection *next_closed;
+};
+
+// Plain query answered from its wire bytes, without indexing it
+typedef struct {
+    unsigned char *reply;   // Cached answer after the headroom
+    int len;
+    int qn_end;
+    int max_size;           // Largest UDP response the client accepts
+} Raw_Answer;
+
+// Reply waiting to be sent as a datagram
+typedef struct {
+    struct sockaddr_in6 addr;
+    socklen_t addr_len;
+    unsigned char buffer[UDP_MAX_SIZE];
+    int len;
+    long replying;
+} Datagram;
+
+// Reply handed to the event loop that owns the connection
+typedef struct delivery Delivery;
+
+struct delivery {
+    Connection *conn;
+    Message *msg;
+
+    Delivery *next;
+};
+
+// Counters and stage latencies of one event loop, only written by its own
+// thread
+typedef struct {
+    atomic_ulong accepted;
+    atomic_ulong datagrams;
+    atomic_ulong queries;
+    atomic_ulong hits;
+    atomic_ulong misses;
+    atomic_ulong notimp;
+    atomic_ulong forwarded;
+    atomic_ulong hedged;
+    atomic_ulong upstream_errors;
+    atomic_ulong failed;
+    atomic_ulong shed;
+
+    Histogram stages[STAGE_COUNT];
+} Worker_Stats;
+
+// Holds server properties for each event loop
+typedef struct {
+    int worker;
+    int cpu;
+    int epfd;
+    Endpoint listener;
+    Endpoint udp;
     Cache *cache;
+    Flight_Table *flights;
+    Connection *closed;
+    Session *closed_sessions;
+
+    // Tick a failed accept is tried again at, 0 while accepting works
+    unsigned long accept_retry;
+
+    // Client connections, closed once idle for too long
+    Timer_Wheel idle;
+
+    // Replies posted by other event loops
+    Endpoint inbox_ep;
+    pthread_mutex_t inbox_lock;
+    Delivery *inbox;
+
+    Datagram *out;
+    int out_count;
+
+    // Deadlines of the queries this loop forwarded upstream, and how many
+    // are still waiting
+    Timer_Wheel deadlines;
+    int forwarding;
+
+    // Queries waiting on an upstream answer, forwarded or parked behind
+    // one. Past MAX_WAITING new misses are refused instead
+    int waiting;
+
+    Worker_Stats stats;
+
+    // Drives the client connections instead of epoll, if set
+    int use_ring;
+    Ring ring;
+    Endpoint poll_ep;
+
+    // Connections to each upstream, with the latency of its answers
+    Upstream *upstreams[MAX_UPSTREAMS][UPSTREAM_CONNS];
+    Endpoint upstream_eps[MAX_UPSTREAMS][UPSTREAM_CONNS];
+    Latency latency[MAX_UPSTREAMS];
+    int upstream_count;
 } Properties;
 
-// Creates a socket for receiving queries
-int create_server_socket();
+// Creates a socket of the given type for receiving queries
+int create_server_socket(int type);
 
-// Creates a socket for forwarding queries and receiving answers
-int create_connection_socket(const char *ip, const int port);
+// Creates the socket the stats are served on, reachable only locally
+int create_metrics_socket(int port);
 
 // Runs miniature DNS server
-void run_server(const char *ip, const int port);
+void run_server(Address *upstreams, int upstream_count,
+    unsigned int capacity, time_t grace, int use_ring, int metrics_port);
+
+// Waits for and dispatches socket events
+void *run_event_loop(void *param);
+
+// Dispatches the events returned by epoll
+void handle_events(Properties *prop, struct epoll_event *events, int count);
+
+// Handles every completion posted to the ring
+void reap_completions(Properties *prop);
 
-// Handles message processing to/from client and server
-void *process_message(void *param);
+// Handles a finished receive on a client connection driven by the ring
+void complete_receive(Properties *prop, Session *session,
+    struct io_uring_cqe *cqe);
 
-// Reads query/response received in the socket
-Message *receive_msg(const int sockfd);
+// Handles a finished send on a client connection driven by the ring
+void complete_send(Properties *prop, Session *session,
+    struct io_uring_cqe *cqe);
+
+// Writes the counters of every event loop to stderr whenever SIGUSR1
+// arrives
+void *run_stats(void *param);
+
+// Adds one to a counter only its own event loop writes
+void count_stat(atomic_ulong *stat);
+
+// Records the time since start against the stage, returns the current time
+long time_stage(Properties *prop, Latency_Stage stage, long start);
+
+// Serves the counters and stage latencies of every event loop, summed, to
+// each connection made to the stats socket
+void *run_metrics(void *param);
+
+// Writes the counters and stage latencies of every event loop, summed, in
+// the Prometheus text format
+void write_metrics(Properties *prop, FILE *out);
+
+// Sums a counter over every event loop, given its offset in Worker_Stats
+unsigned long sum_stat(Properties *prop, size_t offset);
+
+// Accepts all pending client connections
+void accept_clients(Properties *prop);
+
+// Reports a failed accept, such as running out of descriptors, and waits a
+// while before accepting again. The listener is edge triggered, so the
+// connections already waiting would not raise another event
+void defer_accept(Properties *prop);
+
+// Accepts again once the wait after a failed accept is over
+void retry_accept(Properties *prop);
+
+// Creates the state of a newly accepted client connection
+Session *create_client(Properties *prop, int clt_sockfd);
+
+// Reads and handles queued datagrams, many per system call
+void receive_datagrams(Properties *prop);
+
+// Queues a reply to a datagram, truncating it if it does not fit
+void queue_datagram(Properties *prop, Connection *conn);
+
+// Queues a reply to the address, truncating it to max_size if it does not
+// fit
+void queue_packet(Properties *prop, struct sockaddr_in6 *addr,
+    socklen_t addr_len, unsigned char *reply, int size, int qn_end,
+    int max_size, long replying);
+
+// Sends all queued datagram replies, many per system call
+void flush_datagrams(Properties *prop);
+
+// Registers a socket with the event loop
+void watch_endpoint(Properties *prop, Endpoint *ep, u_int32_t events);
+
+// Reads queries from the client connection until it would block or has
+// too many waiting, and writes the replies that are ready
+void process_session(Properties *prop, Session *session);
+
+// Reads from the client connection into its buffer if it is empty, returns
+// 1 if there is anything to take from it
+int read_session(Properties *prop, Session *session);
+
+// Hands the bytes read to the queries they belong to, starting each query
+// as it completes, until the client has too many waiting
+void take_queries(Properties *prop, Session *session);
+
+// Allocates the message the body is read into once the length prefix is
+// complete, closing the connection if the query is empty
+void begin_body(Properties *prop, Session *session);
+
+// Starts answering a query read in full from a client connection
+void begin_query(Properties *prop, Session *session);
+
+// Queues the reply to a query read from a client connection and writes it
+// out if the connection is not busy reading
+void queue_reply(Properties *prop, Connection *conn);
+
+// Adds a reply written after its TCP length prefix to the queue of the
+// client connection
+void queue_outgoing(Session *session, unsigned char *buffer, int len,
+    long replying);
+
+// Writes the queued replies of the client connection, returns 1 if reading
+// stopped for them and can go on
+int send_replies(Properties *prop, Session *session);
+
+// Writes as many queued replies as the socket takes, many per system call,
+// returns -1 if the connection failed
+int write_replies(Properties *prop, Session *session);
+
+// Forgets the first queued reply once it has been written in full
+void finish_reply(Properties *prop, Session *session);
+
+// Closes client connections that have been idle too long
+void expire_sessions(Properties *prop);
+
+// Closes the client connection, keeping its state until every query read
+// from it has finished
+void close_session(Properties *prop, Session *session);
+
+// Frees the state of a closed client connection once nothing refers to it
+void release_session(Properties *prop, Session *session);
+
+// Runs the query's state machine until it would block
+void process_connection(Properties *prop, Connection *conn);
+
+// Answers a plain AAAA query from the cache straight from its wire bytes.
+// Returns 1 if it was found, 0 if it was not and the query has been logged,
+// or -1 if the query has to be indexed in full
+int answer_raw(Properties *prop, unsigned char *query, int size,
+    int headroom, Raw_Answer *raw);
+
+// Handles a complete query received from the client
+void process_message(Properties *prop, Connection *conn);
+
+// Pipelines a query not answered locally to the fastest healthy upstream
+void forward_query(Properties *prop, Connection *conn);
+
+// Sends a copy of a slow query to the next fastest upstream
+void hedge_query(Properties *prop, Connection *conn);
+
+// Gets the index of the healthy upstream with the lowest smoothed round
+// trip time other than exclude, or any other if none is healthy
+int pick_upstream(Properties *prop, int exclude);
+
+// Gets the least busy connection to the upstream
+Upstream *pick_connection(Properties *prop, int index);
+
+// Handles the upstream response to a query, or its failure
+void process_response(void *arg, Upstream *up, void *owner,
+    unsigned char *buffer, int size);
+
+// Stops waiting for the upstreams still holding the query, counting it as
+// a failure of each if it timed out, or else as a round trip at least as
+// long as the wait so far
+void abandon_query(Properties *prop, Connection *conn, int timed_out);
+
+// Schedules the timer for the query's next deadline
+void schedule_deadline(Properties *prop, Connection *conn);
+
+// Answers the queries that passed their deadlines
+void expire_deadlines(Properties *prop);
+
+// Hedges a query the upstream is slow to answer, then answers it with a
+// stale answer if there is one, or else with SERVFAIL once it has waited
+// too long
+void handle_deadline(Properties *prop, Connection *conn);
+
+// Lands the flight of the forwarded query and answers it and every query
+// parked behind it
+void answer_flight(Properties *prop, Connection *conn, Message *msg);
+
+// Answers a query with its own copy of the response, or with SERVFAIL if
+// the query failed
+void deliver_reply(Properties *prop, Connection *conn, Message *msg);
+
+// Hands a reply to the event loop that owns the connection
+void post_reply(Properties *prop, Connection *conn, Message *msg);
+
+// Answers the queries whose replies were handed over by other event loops
+void receive_replies(Properties *prop);
+
+// Frees the state of the query, letting its client connection go if it was
+// the last one waiting on it
+void close_connection(Properties *prop, Connection *conn);
+
+// Indexes the query/response read into the message's buffer
+int receive_msg(Message *msg);
 
 // Transforms message into response with rcode 4
 void set_rcode(Message *msg);
 
-// Sends query/response through the socket
-void send_msg(const int sockfd, Message *msg);
+// Transforms message into response with rcode 2
+void set_servfail(Message *msg);
+
+// Transforms message into response with rcode 5
+void set_refused(Message *msg);
 
-// Sends header through the socket
-void send_hdr(const int sockfd, Header *hdr);
+// Writes query/response into the buffer after its TCP length prefix and
+// returns the total length
+int pack_reply(Message *msg, unsigned char *buffer);
 
-// Sends questions through the socket
-void send_qn(const int sockfd, Question **qn_list, int qn_count);
+// Writes query/response into the buffer and returns its length
+int pack_msg(Message *msg, unsigned char *buffer);
 
-// Sends question name through the socket
-void send_qname(const int sockfd, Question *qn);
+// Writes the reply to a datagram, keeping only the header and questions
+// with the TC bit set if it is larger than max_size
+int pack_datagram(unsigned char *reply, int size, int qn_end, int max_size,
+    unsigned char *buffer);
 
-// Sends answers through the socket
-void send_ans(const int sockfd, Answer **ans_list, int ans_count);
+// Gets the largest UDP response the client accepts, from its EDNS OPT record
+int get_udp_size(Message *msg);
 
 // Checks if rcode is 4
 int check_rcode(Message *msg);
 
-// Reads the next given number of bytes from the socket and stores in buffer
-unsigned char *read_from_sock(const int sockfd, int num_bytes);
+// Reads up to the given number of bytes from the socket into buffer
+int read_from_sock(const int sockfd, unsigned char *buffer, int num_bytes,
+    int *bytes_read);
+
+// Writes what is left of the buffer to the socket, resuming after short writes
+int write_to_sock(const int sockfd, unsigned char *buffer, int num_bytes,
+    int *bytes_written);
+
+// Sets the socket to non-blocking mode
+void set_nonblocking(const int sockfd);
+
+// Gets how long the event loop may wait, shorter while queries are upstream
+// or an accept is to be retried
+int get_timeout(Properties *prop);
+
+// Gets the current tick of the query deadlines
+unsigned long get_tick();
 
 #endif
@@ -0,0 +1,104 @@
+#include "stats.h"
+
+#define NS_PER_SEC 1000000000L
+
+// Adds a duration to a histogram only its own event loop writes
+void record_duration(Histogram *hist, long ns) {
+    if (ns < 0) {
+        ns = 0;
+    }
+
+    add_relaxed(&hist->buckets[get_bucket(ns)], 1);
+    add_relaxed(&hist->count, 1);
+    add_relaxed(&hist->sum, ns);
+}
+
+// Adds the counts of one histogram into another only the caller writes
+void merge_histogram(Histogram *total, Histogram *hist) {
+    int i;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        add_relaxed(&total->buckets[i], atomic_load_explicit(
+            &hist->buckets[i], memory_order_relaxed));
+    }
+    add_relaxed(&total->count,
+        atomic_load_explicit(&hist->count, memory_order_relaxed));
+    add_relaxed(&total->sum,
+        atomic_load_explicit(&hist->sum, memory_order_relaxed));
+}
+
+// Gets the duration below which the given share of the histogram falls
+long get_quantile(Histogram *hist, double share) {
+    unsigned long count = atomic_load_explicit(&hist->count,
+        memory_order_relaxed), seen = 0;
+    int i;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    // Rounds up to the end of the bucket the share falls in
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += atomic_load_explicit(&hist->buckets[i],
+            memory_order_relaxed);
+        if (seen >= share*count) {
+            return get_bucket_limit(i);
+        }
+    }
+
+    return get_bucket_limit(HISTOGRAM_BUCKETS - 1);
+}
+
+// Gets the bucket a duration is counted in
+int get_bucket(long ns) {
+    int msb;
+
+    // Short durations are counted exactly
+    if (ns < SUB_COUNT) {
+        return ns;
+    } else if (ns >= 1L << HISTOGRAM_BITS) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+
+    // The highest set bit picks the power of two, the next SUB_BITS bits
+    // the bucket within it
+    msb = 63 - __builtin_clzl(ns);
+    return (msb - SUB_BITS + 1)*SUB_COUNT +
+        (int)(ns >> (msb - SUB_BITS)) - SUB_COUNT;
+}
+
+// Gets the first duration too long for the bucket
+long get_bucket_limit(int bucket) {
+    int group = bucket / SUB_COUNT, sub = bucket % SUB_COUNT;
+
+    if (group == 0) {
+        return bucket + 1;
+    }
+
+    return (long)(SUB_COUNT + sub + 1) << (group - 1);
+}
+
+// Adds to a counter only the calling thread writes
+void add_relaxed(atomic_ulong *stat, unsigned long value) {
+    // A plain load and store, as no other thread adds to it
+    atomic_store_explicit(stat,
+        atomic_load_explicit(stat, memory_order_relaxed) + value,
+        memory_order_relaxed);
+}
+
+// Gets the name of a stage as shown in the stats
+const char *get_stage_name(Latency_Stage stage) {
+    static const char *names[STAGE_COUNT] = {"read", "parse", "lookup",
+        "upstream", "send"};
+
+    return names[stage];
+}
+
+// Gets the current time in nanoseconds, for timing stages
+long get_nanos() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec*NS_PER_SEC + now.tv_nsec;
+}
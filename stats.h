@@ -0,0 +1,57 @@
+#ifndef STATS
+#define STATS
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#define SUB_BITS 3              // Buckets per power of two, as a power of two
+#define SUB_COUNT (1 << SUB_BITS)
+#define HISTOGRAM_BITS 40       // Durations up to 2^40 ns, longer ones clamp
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_BITS - SUB_BITS + 1)*SUB_COUNT)
+
+// Stages of a query timed by the event loops
+typedef enum {
+    STAGE_READ,         // From a query's first byte to its whole body
+    STAGE_PARSE,        // Indexing the query
+    STAGE_LOOKUP,       // Searching the cache
+    STAGE_UPSTREAM,     // Round trip of an upstream answer
+    STAGE_SEND,         // From the reply being ready to the kernel taking it
+    STAGE_COUNT
+} Latency_Stage;
+
+// Durations in ns, counted in buckets a power of two wide split into
+// SUB_COUNT more, so each is within 1/SUB_COUNT of its bucket. Only written
+// by its own event loop, read by anyone
+typedef struct {
+    atomic_ulong buckets[HISTOGRAM_BUCKETS];
+    atomic_ulong count;
+    atomic_ulong sum;
+} Histogram;
+
+// Adds a duration to a histogram only its own event loop writes
+void record_duration(Histogram *hist, long ns);
+
+// Adds the counts of one histogram into another only the caller writes
+void merge_histogram(Histogram *total, Histogram *hist);
+
+// Gets the duration below which the given share of the histogram falls
+long get_quantile(Histogram *hist, double share);
+
+// Gets the bucket a duration is counted in
+int get_bucket(long ns);
+
+// Gets the first duration too long for the bucket
+long get_bucket_limit(int bucket);
+
+// Adds to a counter only the calling thread writes
+void add_relaxed(atomic_ulong *stat, unsigned long value);
+
+// Gets the name of a stage as shown in the stats
+const char *get_stage_name(Latency_Stage stage);
+
+// Gets the current time in nanoseconds, for timing stages
+long get_nanos();
+
+#endif
@@ -0,0 +1,107 @@
+#include "timer.h"
+
+#define SLOT_MASK (WHEEL_SLOTS - 1)
+#define MAX_DELAY ((1ul << (WHEEL_LEVELS*WHEEL_BITS)) - 1) // Furthest tick
+
+// Sets up an empty wheel starting at the given tick
+void init_wheel(Timer_Wheel *wheel, unsigned long now) {
+    memset(wheel->slots, 0, sizeof(wheel->slots));
+    wheel->now = now;
+}
+
+// Schedules the timer to expire at the given tick
+void add_timer(Timer_Wheel *wheel, Timer *timer, unsigned long deadline) {
+    unsigned long delay, tick;
+    int level = 0;
+
+    // Timers already due fire on the next tick
+    timer->deadline = deadline;
+    tick = deadline > wheel->now ? deadline : wheel->now + 1;
+    delay = tick - wheel->now;
+
+    // Timers beyond the last wheel wait there and are rescheduled when
+    // their slot comes around
+    if (delay > MAX_DELAY) {
+        tick = wheel->now + MAX_DELAY;
+        delay = MAX_DELAY;
+    }
+
+    while (level < WHEEL_LEVELS - 1 &&
+        delay >= (1ul << ((level + 1)*WHEEL_BITS))) {
+        level++;
+    }
+
+    link_timer(&wheel->slots[level][(tick >> (level*WHEEL_BITS)) & SLOT_MASK],
+        timer);
+}
+
+// Links the timer at the head of a slot
+void link_timer(Timer **slot, Timer *timer) {
+    timer->next = *slot;
+    if (timer->next) {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+// Unschedules the timer if it is scheduled
+void remove_timer(Timer *timer) {
+    if (!timer->pprev) {
+        return;
+    }
+
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+// Moves the wheel up to the given tick and returns the timers that
+// expired on the way, linked through next
+Timer *advance_wheel(Timer_Wheel *wheel, unsigned long now) {
+    Timer *expired = NULL, *timer = NULL;
+    int level, slot;
+
+    while (wheel->now < now) {
+        wheel->now++;
+
+        // Each time a wheel wraps, the next slot of the one above is due
+        for (level = 1; level < WHEEL_LEVELS; level++) {
+            if ((wheel->now >> ((level - 1)*WHEEL_BITS)) & SLOT_MASK) {
+                break;
+            }
+            cascade_slot(wheel, level,
+                (wheel->now >> (level*WHEEL_BITS)) & SLOT_MASK);
+        }
+
+        slot = wheel->now & SLOT_MASK;
+        while ((timer = wheel->slots[0][slot])) {
+            remove_timer(timer);
+            timer->next = expired;
+            expired = timer;
+        }
+    }
+
+    return expired;
+}
+
+// Puts the timers of a higher wheel's slot back where they now belong
+void cascade_slot(Timer_Wheel *wheel, int level, int slot) {
+    Timer *timer = wheel->slots[level][slot], *next = NULL;
+
+    wheel->slots[level][slot] = NULL;
+    while (timer) {
+        next = timer->next;
+
+        // Timers due on this tick join the slot about to expire
+        if (timer->deadline <= wheel->now) {
+            link_timer(&wheel->slots[0][wheel->now & SLOT_MASK], timer);
+        } else {
+            add_timer(wheel, timer, timer->deadline);
+        }
+        timer = next;
+    }
+}
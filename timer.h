@@ -0,0 +1,48 @@
+#ifndef TIMER
+#define TIMER
+
+#include <stdlib.h>
+#include <string.h>
+
+#define WHEEL_LEVELS 4  // Wheels, each counting in ticks of the one below
+#define WHEEL_BITS 6    // Slots of each wheel as a power of two
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+
+// Timer linked into a slot of a wheel
+typedef struct timer Timer;
+
+struct timer {
+    unsigned long deadline;
+    void *owner;
+
+    Timer *next;
+    Timer **pprev;  // Link pointing to this timer, NULL if not scheduled
+};
+
+// Hierarchical timer wheel. The lowest wheel holds timers due within
+// WHEEL_SLOTS ticks, each higher one covers WHEEL_SLOTS times as many
+typedef struct {
+    Timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    unsigned long now;
+} Timer_Wheel;
+
+// Sets up an empty wheel starting at the given tick
+void init_wheel(Timer_Wheel *wheel, unsigned long now);
+
+// Schedules the timer to expire at the given tick
+void add_timer(Timer_Wheel *wheel, Timer *timer, unsigned long deadline);
+
+// Links the timer at the head of a slot
+void link_timer(Timer **slot, Timer *timer);
+
+// Unschedules the timer if it is scheduled
+void remove_timer(Timer *timer);
+
+// Moves the wheel up to the given tick and returns the timers that
+// expired on the way, linked through next
+Timer *advance_wheel(Timer_Wheel *wheel, unsigned long now);
+
+// Puts the timers of a higher wheel's slot back where they now belong
+void cascade_slot(Timer_Wheel *wheel, int level, int slot);
+
+#endif